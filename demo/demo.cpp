@@ -7,6 +7,7 @@
 #include <dirent.h>
 #include <fnmatch.h>
 #include <time.h>
+#include <sys/stat.h>
 
 #include <opencv2/imgcodecs.hpp>
 #include "video_writer_core.h"
@@ -23,6 +24,12 @@ std::string to_string(T value) {
 }
 
 int main(int argc, char **argv) {
+    // 设置VIDEO_WRITER_TRACE=trace.json时导出各阶段耗时，用chrome://tracing或Perfetto查看
+    const char *trace_file = getenv("VIDEO_WRITER_TRACE");
+    if(trace_file != nullptr) {
+        video_writer::enable_tracing(true);
+    }
+
     video_writer writer(25, cv::Size(1280, 720));
     //video_writer writer(25, cv::Size(854, 480));
 
@@ -63,46 +70,17 @@ int main(int argc, char **argv) {
     // 刷新编码器，表示Mat输入流结束
     writer.flush();
 
-    FILE *file = fopen("../test.pcm", "rb");
-    if(file == nullptr) {
+    // 直接mmap音频文件逐帧编码，不再分块读入内存
+    struct stat pcm_stat;
+    if(stat("../test.pcm", &pcm_stat) != 0) {
         std::cerr << "Error: could not open input pcm file: test.pcm." << std::endl;
         return 0;
     }
+    int64_t file_size = pcm_stat.st_size;
 
-    // 获取文件大小
-    fseek(file, 0, SEEK_END);
-    int64_t file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    // 计算每次读取的字节数
-    int64_t chunk_size = file_size / 10;
-    // 分配内存
-    char *buffer = (char *)malloc(chunk_size);
-    if(buffer == nullptr) {
-        std::cerr << "Error: could not alloc pcm buffer." << std::endl;
-        fclose(file);
-        return 0;
-    }
-
-    clock_t audio_start = 0, audio_end = 0;
-    int64_t read_size = 0;
-    // 多次读取pcm文件
-    while(read_size < file_size) {
-        if(read_size + chunk_size > file_size) {
-            chunk_size = file_size - read_size;
-        }
-
-        fread(buffer, 1, chunk_size, file);
-        read_size += chunk_size;
-
-        audio_start = clock();
-        writer.input_audio(buffer, chunk_size);
-        audio_end = clock();
-        audio_time += audio_end - audio_start;
-    }
-
-    free(buffer);
-    fclose(file);
+    clock_t audio_start = clock();
+    writer.input_audio_file("../test.pcm");
+    audio_time = clock() - audio_start;
 
     clock_t mux_start = 0, mux_end = 0;
     mux_start = clock();
@@ -121,5 +99,9 @@ int main(int argc, char **argv) {
     std::cout << "audio_time = " << double(audio_time) / CLOCKS_PER_SEC << "s" << std::endl;
     std::cout << "mux_time = " << double(mux_time) / CLOCKS_PER_SEC << "s" << std::endl;
 
+    if(trace_file != nullptr) {
+        video_writer::write_trace(trace_file);
+    }
+
     return 0;
 }
@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+extern "C" {
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+}
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include "video_writer_core.h"
+
+// 一组编码参数的测量结果
+typedef struct {
+    VideoEncoderConfig config;
+    double wall_seconds;
+    double cpu_seconds;
+    double fps;
+    int64_t bytes;
+    double psnr;            // 亮度平面逐帧PSNR均值，dB
+    double ssim;            // 亮度平面SSIM均值
+    int decoded_frames;
+    bool failed;            // 编码失败或解码帧数不足，不参与比较
+    bool pareto;            // CPU时间、输出大小、SSIM三者上不被其他结果支配
+}SweepResult;
+
+static void usage(const char *program_name) {
+    std::cout << "usage: " << std::string(program_name) << " [options] [png_file_dir]" << std::endl
+              << "  没有png_file_dir时使用合成画面" << std::endl
+              << "  --frames N          最多使用的帧数，默认60" << std::endl
+              << "  --size WxH          合成画面尺寸，默认1280x720" << std::endl
+              << "  --fps N             帧率，默认25" << std::endl
+              << "  --presets a,b       默认ultrafast,veryfast,medium,slow" << std::endl
+              << "  --bitrates k1,k2    码率kbps，默认1000,2000" << std::endl
+              << "  --crfs c1,c2        恒定质量，默认23" << std::endl
+              << "  --gops g1,g2        关键帧间隔，默认10,50" << std::endl
+              << "  --threads t1,t2     编码线程数，0为自动，默认0" << std::endl
+              << "  --json file         结果输出，默认sweep.json" << std::endl
+              << "  --verbose           保留编码日志" << std::endl;
+}
+
+static std::vector<std::string> split(const std::string &text, char separator) {
+    std::vector<std::string> items;
+    size_t begin = 0;
+    while(begin <= text.size()) {
+        size_t end = text.find(separator, begin);
+        if(end == std::string::npos) {
+            end = text.size();
+        }
+        if(end > begin) {
+            items.push_back(text.substr(begin, end - begin));
+        }
+        begin = end + 1;
+    }
+    return items;
+}
+
+static std::vector<int64_t> split_numbers(const std::string &text) {
+    std::vector<int64_t> numbers;
+    std::vector<std::string> items = split(text, ',');
+    for(size_t i = 0; i < items.size(); i++) {
+        numbers.push_back(atoll(items[i].c_str()));
+    }
+    return numbers;
+}
+
+static std::vector<cv::Mat> load_png_frames(const std::string &directory, int max_frames) {
+    std::vector<std::string> png_files;
+    std::vector<cv::Mat> frames;
+
+    DIR *dir = opendir(directory.c_str());
+    if(dir == nullptr) {
+        std::cerr << "Error: could not open input file dir " << directory << std::endl;
+        return frames;
+    }
+    struct dirent *entry;
+    while((entry = readdir(dir)) != nullptr) {
+        if(fnmatch("*.png", entry->d_name, 0) == 0) {
+            png_files.push_back(directory + "/" + entry->d_name);
+        }
+    }
+    closedir(dir);
+    std::sort(png_files.begin(), png_files.end());
+
+    for(size_t i = 0; i < png_files.size() && (int)frames.size() < max_frames; i++) {
+        cv::Mat image = cv::imread(png_files[i]);
+        if(!image.empty()) {
+            frames.push_back(image);
+        }
+    }
+    return frames;
+}
+
+// 平移的渐变背景加运动方块，同时包含平坦区域、边缘和运动
+static std::vector<cv::Mat> synthetic_frames(cv::Size size, int count) {
+    std::vector<cv::Mat> frames;
+    for(int i = 0; i < count; i++) {
+        cv::Mat image(size.height, size.width, CV_8UC3);
+        for(int y = 0; y < size.height; y++) {
+            uint8_t *row = image.ptr<uint8_t>(y);
+            for(int x = 0; x < size.width; x++) {
+                row[x * 3] = (uint8_t)((x + i * 4) & 255);
+                row[x * 3 + 1] = (uint8_t)((y + i * 2) & 255);
+                row[x * 3 + 2] = (uint8_t)(((x ^ y) >> 2) & 255);
+            }
+        }
+        int box = size.height / 4;
+        int x = (i * 16) % std::max(1, size.width - box);
+        cv::rectangle(image, cv::Rect(x, size.height / 3, box, box), cv::Scalar(255, 255, 255), -1);
+        frames.push_back(image);
+    }
+    return frames;
+}
+
+static double plane_psnr(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height) {
+    uint64_t sse = 0;
+    for(int y = 0; y < height; y++) {
+        for(int x = 0; x < width; x++) {
+            int diff = a[y * a_stride + x] - b[y * b_stride + x];
+            sse += diff * diff;
+        }
+    }
+    if(sse == 0) {
+        return 100.0;
+    }
+    double mse = (double)sse / ((double)width * height);
+    return 10.0 * log10(255.0 * 255.0 / mse);
+}
+
+// 8x8窗口、步长4的SSIM，与x264的统计方式一致
+static double plane_ssim(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height) {
+    const double c1 = (0.01 * 255) * (0.01 * 255);
+    const double c2 = (0.03 * 255) * (0.03 * 255);
+    double total = 0;
+    int count = 0;
+    for(int y = 0; y + 8 <= height; y += 4) {
+        for(int x = 0; x + 8 <= width; x += 4) {
+            int64_t sum_a = 0, sum_b = 0, sum_aa = 0, sum_bb = 0, sum_ab = 0;
+            for(int dy = 0; dy < 8; dy++) {
+                const uint8_t *pa = a + (y + dy) * a_stride + x;
+                const uint8_t *pb = b + (y + dy) * b_stride + x;
+                for(int dx = 0; dx < 8; dx++) {
+                    sum_a += pa[dx];
+                    sum_b += pb[dx];
+                    sum_aa += pa[dx] * pa[dx];
+                    sum_bb += pb[dx] * pb[dx];
+                    sum_ab += pa[dx] * pb[dx];
+                }
+            }
+            double mean_a = sum_a / 64.0, mean_b = sum_b / 64.0;
+            double var_a = sum_aa / 64.0 - mean_a * mean_a;
+            double var_b = sum_bb / 64.0 - mean_b * mean_b;
+            double cov = sum_ab / 64.0 - mean_a * mean_b;
+            total += ((2 * mean_a * mean_b + c1) * (2 * cov + c2))
+                     / ((mean_a * mean_a + mean_b * mean_b + c1) * (var_a + var_b + c2));
+            count++;
+        }
+    }
+    return count > 0 ? total / count : 1.0;
+}
+
+// 解码输出文件，按显示顺序与源帧的I420亮度平面比较
+static int32_t decode_and_score(const char *h264_file, const std::vector<cv::Mat> &reference, SweepResult &result) {
+    AVFormatContext *fmt_ctx = nullptr;
+    if(avformat_open_input(&fmt_ctx, h264_file, nullptr, nullptr) < 0 || avformat_find_stream_info(fmt_ctx, nullptr) < 0) {
+        std::cerr << "Error: could not open encoded file " << h264_file << std::endl;
+        avformat_close_input(&fmt_ctx);
+        return -1;
+    }
+
+    int stream_idx = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    const AVCodec *decoder = stream_idx >= 0 ? avcodec_find_decoder(fmt_ctx->streams[stream_idx]->codecpar->codec_id) : nullptr;
+    AVCodecContext *codec_ctx = decoder ? avcodec_alloc_context3(decoder) : nullptr;
+    if(!codec_ctx || avcodec_parameters_to_context(codec_ctx, fmt_ctx->streams[stream_idx]->codecpar) < 0
+       || avcodec_open2(codec_ctx, decoder, nullptr) < 0) {
+        std::cerr << "Error: could not open decoder for " << h264_file << std::endl;
+        avcodec_free_context(&codec_ctx);
+        avformat_close_input(&fmt_ctx);
+        return -1;
+    }
+
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    double psnr_total = 0, ssim_total = 0;
+    int frame_index = 0;
+    bool reading = true;
+    while(1) {
+        if(reading) {
+            if(av_read_frame(fmt_ctx, pkt) < 0) {
+                reading = false;
+                avcodec_send_packet(codec_ctx, nullptr);
+            }
+            else {
+                if(pkt->stream_index == stream_idx) {
+                    avcodec_send_packet(codec_ctx, pkt);
+                }
+                av_packet_unref(pkt);
+            }
+        }
+
+        int ret = 0;
+        while((ret = avcodec_receive_frame(codec_ctx, frame)) >= 0) {
+            if(frame_index < (int)reference.size()) {
+                const cv::Mat &yuv = reference[frame_index];
+                psnr_total += plane_psnr(frame->data[0], frame->linesize[0], yuv.data, yuv.step, frame->width, frame->height);
+                ssim_total += plane_ssim(frame->data[0], frame->linesize[0], yuv.data, yuv.step, frame->width, frame->height);
+            }
+            frame_index++;
+            av_frame_unref(frame);
+        }
+        if(ret == AVERROR_EOF || (!reading && ret != AVERROR(EAGAIN))) {
+            break;
+        }
+    }
+
+    int scored = std::min(frame_index, (int)reference.size());
+    result.decoded_frames = frame_index;
+    result.psnr = scored > 0 ? psnr_total / scored : 0;
+    result.ssim = scored > 0 ? ssim_total / scored : 0;
+
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&codec_ctx);
+    avformat_close_input(&fmt_ctx);
+    return frame_index == (int)reference.size() ? 0 : -1;
+}
+
+static int32_t run_one(const VideoEncoderConfig &config, const std::vector<cv::Mat> &frames,
+                       const std::vector<cv::Mat> &reference, int frame_rate, bool verbose, SweepResult &result) {
+    result.config = config;
+    std::string h264_file = "sweep_" + std::to_string((long long)getpid()) + ".h264";
+
+    // 编码日志每帧一行，默认关闭
+    std::streambuf *cout_buffer = std::cout.rdbuf();
+    if(!verbose) {
+        std::cout.rdbuf(nullptr);
+    }
+
+    std::chrono::steady_clock::time_point wall_start = std::chrono::steady_clock::now();
+    clock_t cpu_start = clock();
+    int32_t ret = 0;
+    {
+        video_writer writer(frame_rate, frames[0].size());
+        ret = writer.set_video_encoder_config(config);
+        for(size_t i = 0; ret >= 0 && i < frames.size(); i++) {
+            ret = writer.input_image(frames[i]);
+        }
+        writer.flush();
+        if(ret >= 0) {
+            ret = writer.write_h264((char *)h264_file.c_str());
+        }
+    }
+    result.cpu_seconds = double(clock() - cpu_start) / CLOCKS_PER_SEC;
+    result.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+    result.fps = result.wall_seconds > 0 ? frames.size() / result.wall_seconds : 0;
+
+    std::cout.rdbuf(cout_buffer);
+    std::cout.clear();
+    if(ret < 0) {
+        std::cerr << "Error: encode failed with preset " << config.preset << std::endl;
+        unlink(h264_file.c_str());
+        return ret;
+    }
+
+    struct stat st;
+    result.bytes = stat(h264_file.c_str(), &st) == 0 ? st.st_size : 0;
+    ret = decode_and_score(h264_file.c_str(), reference, result);
+    unlink(h264_file.c_str());
+    return ret;
+}
+
+// 标记Pareto最优：没有其他结果在CPU时间、输出大小和SSIM上都不差且至少一项更好
+// 失败的结果大小为0，会支配所有结果，不参与比较
+static void mark_pareto(std::vector<SweepResult> &results) {
+    for(size_t i = 0; i < results.size(); i++) {
+        results[i].pareto = !results[i].failed;
+        for(size_t j = 0; j < results.size() && results[i].pareto; j++) {
+            if(results[j].failed) {
+                continue;
+            }
+            const SweepResult &a = results[j], &b = results[i];
+            bool no_worse = a.cpu_seconds <= b.cpu_seconds && a.bytes <= b.bytes && a.ssim >= b.ssim;
+            bool better = a.cpu_seconds < b.cpu_seconds || a.bytes < b.bytes || a.ssim > b.ssim;
+            if(i != j && no_worse && better) {
+                results[i].pareto = false;
+                break;
+            }
+        }
+    }
+}
+
+static void print_table(const std::vector<SweepResult> &results) {
+    printf("%-10s %8s %4s %4s %3s %8s %8s %8s %10s %8s %7s %s\n", "preset", "kbps", "crf", "gop", "thr",
+           "fps", "wall_s", "cpu_s", "bytes", "psnr_y", "ssim_y", "pareto");
+    for(size_t i = 0; i < results.size(); i++) {
+        const SweepResult &r = results[i];
+        printf("%-10s %8lld %4d %4d %3d %8.2f %8.3f %8.3f %10lld %8.3f %7.5f %s\n", r.config.preset.c_str(),
+               (long long)(r.config.crf > 0 ? 0 : r.config.bit_rate / 1000), r.config.crf, r.config.gop_size,
+               r.config.thread_count, r.fps, r.wall_seconds, r.cpu_seconds, (long long)r.bytes, r.psnr, r.ssim,
+               r.failed ? "failed" : (r.pareto ? "*" : ""));
+    }
+}
+
+static int32_t write_json(const std::string &json_file, const std::vector<SweepResult> &results, int frame_count, cv::Size size) {
+    FILE *output = fopen(json_file.c_str(), "w");
+    if(output == nullptr) {
+        std::cerr << "Error: could not open " << json_file << std::endl;
+        return -1;
+    }
+    fprintf(output, "{\"frames\":%d,\"width\":%d,\"height\":%d,\"results\":[\n", frame_count, size.width, size.height);
+    for(size_t i = 0; i < results.size(); i++) {
+        const SweepResult &r = results[i];
+        fprintf(output, "  {\"preset\":\"%s\",\"bit_rate\":%lld,\"crf\":%d,\"gop_size\":%d,\"max_b_frames\":%d,\"threads\":%d,"
+                        "\"fps\":%.3f,\"wall_seconds\":%.4f,\"cpu_seconds\":%.4f,\"bytes\":%lld,"
+                        "\"psnr_y\":%.4f,\"ssim_y\":%.6f,\"decoded_frames\":%d,\"failed\":%s,\"pareto\":%s}%s\n",
+                r.config.preset.c_str(), (long long)(r.config.crf > 0 ? 0 : r.config.bit_rate), r.config.crf,
+                r.config.gop_size, r.config.max_b_frames, r.config.thread_count, r.fps, r.wall_seconds, r.cpu_seconds,
+                (long long)r.bytes, r.psnr, r.ssim, r.decoded_frames, r.failed ? "true" : "false", r.pareto ? "true" : "false",
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(output, "]}\n");
+    fclose(output);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    std::string png_file_dir, json_file = "sweep.json";
+    int max_frames = 60, frame_rate = 25;
+    cv::Size size(1280, 720);
+    bool verbose = false;
+    std::vector<std::string> presets = split("ultrafast,veryfast,medium,slow", ',');
+    std::vector<int64_t> bitrates = split_numbers("1000,2000");
+    std::vector<int64_t> crfs = split_numbers("23");
+    std::vector<int64_t> gops = split_numbers("10,50");
+    std::vector<int64_t> threads = split_numbers("0");
+
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if(arg == "--frames" && has_value) {
+            max_frames = atoi(argv[++i]);
+        }
+        else if(arg == "--size" && has_value) {
+            sscanf(argv[++i], "%dx%d", &size.width, &size.height);
+        }
+        else if(arg == "--fps" && has_value) {
+            frame_rate = atoi(argv[++i]);
+        }
+        else if(arg == "--presets" && has_value) {
+            presets = split(argv[++i], ',');
+        }
+        else if(arg == "--bitrates" && has_value) {
+            bitrates = split_numbers(argv[++i]);
+        }
+        else if(arg == "--crfs" && has_value) {
+            crfs = split_numbers(argv[++i]);
+        }
+        else if(arg == "--gops" && has_value) {
+            gops = split_numbers(argv[++i]);
+        }
+        else if(arg == "--threads" && has_value) {
+            threads = split_numbers(argv[++i]);
+        }
+        else if(arg == "--json" && has_value) {
+            json_file = argv[++i];
+        }
+        else if(arg == "--verbose") {
+            verbose = true;
+        }
+        else if(arg[0] != '-' && png_file_dir.empty()) {
+            png_file_dir = arg;
+        }
+        else {
+            usage(argv[0]);
+            return 0;
+        }
+    }
+
+    std::vector<cv::Mat> frames = png_file_dir.empty() ? synthetic_frames(size, max_frames) : load_png_frames(png_file_dir, max_frames);
+    if(frames.empty()) {
+        std::cerr << "Error: no input frames." << std::endl;
+        return 0;
+    }
+    size = frames[0].size();
+
+    // 参考帧与编码器输入使用相同的颜色转换
+    std::vector<cv::Mat> reference;
+    for(size_t i = 0; i < frames.size(); i++) {
+        cv::Mat yuv;
+        cv::cvtColor(frames[i], yuv, cv::COLOR_BGR2YUV_I420);
+        reference.push_back(yuv);
+    }
+
+    // 码率模式与恒定质量模式一起扫描
+    std::vector<std::pair<int64_t, int> > rates;
+    for(size_t i = 0; i < bitrates.size(); i++) {
+        rates.push_back(std::make_pair(bitrates[i] * 1000, 0));
+    }
+    for(size_t i = 0; i < crfs.size(); i++) {
+        rates.push_back(std::make_pair((int64_t)0, (int)crfs[i]));
+    }
+
+    std::vector<SweepResult> results;
+    for(size_t p = 0; p < presets.size(); p++) {
+        for(size_t r = 0; r < rates.size(); r++) {
+            for(size_t g = 0; g < gops.size(); g++) {
+                for(size_t t = 0; t < threads.size(); t++) {
+                    VideoEncoderConfig config;
+                    config.preset = presets[p];
+                    config.bit_rate = rates[r].first;
+                    config.crf = rates[r].second;
+                    config.gop_size = gops[g];
+                    config.max_b_frames = 3;
+                    config.thread_count = threads[t];
+
+                    SweepResult result = SweepResult();
+                    std::cout << "Run " << results.size() + 1 << ": preset " << config.preset << ", kbps " << config.bit_rate / 1000
+                              << ", crf " << config.crf << ", gop " << config.gop_size << ", threads " << config.thread_count << std::endl;
+                    if(run_one(config, frames, reference, frame_rate, verbose, result) < 0) {
+                        result.failed = true;
+                        std::cerr << "Warning: run " << results.size() + 1 << " did not decode all frames." << std::endl;
+                    }
+                    results.push_back(result);
+                }
+            }
+        }
+    }
+
+    mark_pareto(results);
+    print_table(results);
+    write_json(json_file, results, frames.size(), size);
+    return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef VIDEO_AUDIO_FILE_H
+#define VIDEO_AUDIO_FILE_H
+#include <stdint.h>
+#include <stddef.h>
+
+extern "C" {
+    #include <libavutil/samplefmt.h>
+}
+
+// 只读mmap的PCM或WAV文件，WAV从RIFF头解析格式，裸PCM使用调用方给定的格式
+class audio_file_map {
+    private:
+        uint8_t *mapping = nullptr;
+        size_t mapping_size = 0;
+        const uint8_t *samples = nullptr;
+        size_t samples_size = 0;
+        size_t released = 0;
+
+        int parsed_sample_rate = 0;
+        int parsed_channels = 0;
+        AVSampleFormat parsed_sample_fmt = AV_SAMPLE_FMT_NONE;
+
+        int32_t parse_wav();
+
+    public:
+        ~audio_file_map();
+
+        // 不是WAV文件时按sample_rate、channels、sample_fmt作为裸PCM
+        int32_t open(const char *audio_file, int sample_rate, int channels, AVSampleFormat sample_fmt);
+        void close();
+        // 已处理的数据不再需要，归还映射的物理页
+        void release(size_t offset);
+
+        // 交错PCM数据
+        const uint8_t *data();
+        size_t size();
+        int sample_rate();
+        int channels();
+        AVSampleFormat sample_fmt();
+};
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef VIDEO_AUDIO_MIXER_H
+#define VIDEO_AUDIO_MIXER_H
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+extern "C" {
+    #include <libavutil/frame.h>
+    #include <libavutil/audio_fifo.h>
+    #include <libswresample/swresample.h>
+}
+
+typedef struct {
+    struct SwrContext *swr;         // 重采样到编码器格式
+    AVAudioFifo *fifo;              // 重采样后待混合的FLTP数据
+    int channels;
+    enum AVSampleFormat sample_fmt;
+    float gain;                     // 当前增益
+    float gain_step;                // 渐变时每个采样的增益变化
+    int ramp_samples;               // 剩余渐变采样数
+    int64_t position;               // fifo首个采样在输出时间轴上的位置，单位为输出采样
+    bool ended;
+}AudioTrack;
+
+// 多轨PCM混音，各轨道独立重采样后按帧增量混合为编码器所需的FLTP帧
+// 输入只缓存未混合部分，不需要完整缓存任何轨道
+class audio_mixer {
+    private:
+        int sample_rate;
+        int channels;
+        uint64_t channel_layout;
+        // 轨道落后超过该采样数时视为欠载，补静音
+        // 补静音的时间段已经输出，之后迟到的同一段数据会被丢弃，保持各轨道对齐
+        int max_lag;
+        // 已混合输出的采样数
+        int64_t mixed_samples = 0;
+        std::map<std::string, AudioTrack> tracks;
+        // 重采样输出的临时平面
+        std::vector<std::vector<float> > convert_planes;
+
+        AudioTrack *find(const std::string &name);
+        void drop_late(AudioTrack &track);
+        int32_t push_converted(AudioTrack &track, const uint8_t **data, int nb_samples);
+
+    public:
+        audio_mixer(int sample_rate, int channels, uint64_t channel_layout);
+        ~audio_mixer();
+
+        // 只支持交错格式(U8/S16/S32/FLT/DBL)，轨道从当前混合位置开始
+        int32_t add_track(const std::string &name, int sample_rate, int channels, enum AVSampleFormat sample_fmt);
+        int32_t write(const std::string &name, const uint8_t *data, size_t size);
+        // 增益在ramp_samples个输出采样内线性渐变到gain
+        int32_t set_gain(const std::string &name, float gain, int ramp_samples);
+        // 结束轨道，其剩余数据混合完后以静音补齐
+        int32_t end_track(const std::string &name);
+
+        // 混合一帧到frame(FLTP，nb_samples已设置)，没有足够数据时返回false
+        // drain为true时只要有剩余数据就混合，不足部分补静音
+        bool mix_frame(AVFrame *frame, bool drain);
+        bool all_ended();
+        size_t buffered_bytes();
+};
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef VIDEO_ENCODER_CALIBRATION_H
+#define VIDEO_ENCODER_CALIBRATION_H
+#include <stdint.h>
+#include <string>
+
+extern "C" {
+    #include <libavcodec/avcodec.h>
+}
+
+#include <opencv2/core/core.hpp>
+
+#include "video_writer_types.h"
+
+// x264 preset从慢到快排列，质量依次降低
+extern const char *const ENCODER_PRESETS[];
+extern const int ENCODER_PRESET_COUNT;
+
+typedef struct {
+    std::string preset;
+    int thread_count;
+    double fps;             // 校准时测得的编码帧率
+}CalibrationResult;
+
+// 返回preset在ENCODER_PRESETS中的位置，未知时返回-1
+int preset_index(const std::string &preset);
+
+// 将编码参数设置到codec_ctx，video_writer编码与校准共用，保证两者的码率控制与关键帧设置一致
+// fixed_headers为true时固定写入SPS/PPS的x264参数，运行中切换preset后码流头不变
+void apply_video_encoder_config(AVCodecContext *codec_ctx, const VideoEncoderConfig &config, const KeyframeConfig &keyframes,
+                                bool fixed_headers);
+
+// 用合成BGR画面测量颜色转换加libx264编码在config下的帧率，frames为测量帧数
+double measure_encoder_fps(const VideoEncoderConfig &config, const KeyframeConfig &keyframes, bool fixed_headers,
+                           cv::Size size, int frame_rate, AVRational time_base, int frames);
+
+// 从config.preset开始逐级变快，每个preset从少到多尝试线程数，其余参数按config
+// 选择第一个达到frame_rate * margin的组合，都达不到时返回最快的组合与1
+// 结果按主机、分辨率和除线程数外的全部参数缓存在cache_directory，再次调用直接读取
+int32_t calibrate_encoder(const VideoEncoderConfig &config, const KeyframeConfig &keyframes, bool fixed_headers,
+                          cv::Size size, int frame_rate, AVRational time_base, double margin,
+                          const std::string &cache_directory, CalibrationResult &result);
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef VIDEO_FRAME_SPOOL_H
+#define VIDEO_FRAME_SPOOL_H
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <functional>
+
+extern "C" {
+    #include <libavutil/frame.h>
+}
+
+#include "video_writer_types.h"
+
+#define FRAME_SPOOL_MAGIC "VWSP"
+#define FRAME_SPOOL_VERSION 1
+// 每个分段文件存放的帧数
+#define FRAME_SPOOL_SEGMENT_FRAMES 64
+
+#define TRANSCODE_CHECKPOINT_MAGIC "VWTC"
+#define TRANSCODE_CHECKPOINT_VERSION 1
+// 转码检查点的大致间隔，实际按GOP对齐
+#define TRANSCODE_CHECKPOINT_SECONDS 10
+
+// 采集缓存目录：spool.hdr | frames.idx | seg_00000.yuv ... | audio.pcm
+// 分段文件按帧连续存放YUV420P平面，无行填充
+// frames.idx在像素写入后追加，中断时只丢失最后一帧
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    int32_t width;
+    int32_t height;
+    int32_t time_base_num;          // 帧时间戳的时间基
+    int32_t time_base_den;
+    int32_t sample_rate;            // audio.pcm为交错PCM
+    int32_t channels;
+    int32_t bytes_per_sample;
+    int32_t complete;               // 采集正常结束时为1
+}FrameSpoolHeader;
+
+typedef struct {
+    int64_t pts;
+    int64_t duration;
+}FrameSpoolRecord;
+
+// 转码检查点，与采集缓存放在同一目录：transcode.ckpt | transcode.h264 | transcode.pkt
+// h264与pkt只追加，ckpt记录其中有效的长度，先写数据再改名替换ckpt，中断时回到上一个检查点
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    char settings[256];             // 编码参数，不一致时从头转码
+    int64_t frames_done;            // 已编码的帧数，检查点处编码器已刷新
+    int64_t video_bytes;            // transcode.h264的有效字节数
+    int64_t packet_count;           // transcode.pkt中有效的PacketTiming数
+    int64_t frame_pts;              // 恢复writer的时间戳状态，单位为编码器时间基
+    int64_t last_video_pts;
+    int64_t last_video_duration;
+}TranscodeCheckpoint;
+
+// 转码进度，done/total为帧数
+typedef std::function<void(int64_t done, int64_t total)> spool_progress_callback;
+
+// 采集端，帧通过mmap写入分段文件，由内核在后台回写磁盘
+class frame_spool_writer {
+    private:
+        std::string directory;
+        FrameSpoolHeader header;
+        size_t frame_bytes = 0;
+        int64_t frame_count = 0;
+        int index_fd = -1;
+        int audio_fd = -1;
+        uint8_t *segment = nullptr;
+        int64_t segment_index = -1;
+
+        int32_t map_segment(int64_t index);
+        void unmap_segment(int64_t used_frames);
+        int32_t write_header();
+
+    public:
+        ~frame_spool_writer();
+
+        int32_t open(const std::string &directory, int width, int height, int time_base_num, int time_base_den,
+                     int sample_rate, int channels, int bytes_per_sample);
+        // frame需为YUV420P，尺寸与open时一致
+        int32_t append(const AVFrame *frame, int64_t pts, int64_t duration);
+        int32_t append_audio(const uint8_t *data, size_t size);
+        // 截断最后的分段并标记采集完成
+        int32_t finish();
+        int64_t size();
+};
+
+// 转码端，只读mmap分段与音频文件
+class frame_spool_reader {
+    private:
+        std::string directory;
+        FrameSpoolHeader header;
+        size_t frame_bytes = 0;
+        std::vector<FrameSpoolRecord> records;
+        const uint8_t *segment = nullptr;
+        size_t segment_size = 0;
+        int64_t segment_index = -1;
+        const uint8_t *audio = nullptr;
+        size_t audio_size = 0;
+
+        void unmap_segment();
+
+    public:
+        ~frame_spool_reader();
+
+        int32_t open(const std::string &directory);
+        void close();
+
+        const FrameSpoolHeader &get_header();
+        int64_t size();
+        const FrameSpoolRecord &record(int64_t index);
+        // 拷贝第index帧到frame，frame需已分配YUV420P缓存
+        int32_t read(int64_t index, AVFrame *frame);
+        const uint8_t *audio_data();
+        size_t audio_bytes();
+};
+
+// 转码检查点，中断后重新转码同一缓存时从最后一个检查点继续
+class transcode_checkpoint {
+    private:
+        std::string directory;
+        FILE *video_file = nullptr;
+        FILE *packet_file = nullptr;
+
+        int32_t open_data(bool keep);
+        void close_data();
+
+    public:
+        ~transcode_checkpoint();
+
+        // 读取已有检查点的状态、码流与包时间，不存在或settings不一致时state.frames_done为0
+        int32_t open(const std::string &directory, const std::string &settings, TranscodeCheckpoint &state,
+                     std::vector<uint8_t> &video, std::vector<PacketTiming> &packets);
+        // 追加上次检查点之后的码流与包时间，然后替换状态
+        int32_t save(const TranscodeCheckpoint &state, const uint8_t *video, size_t video_size,
+                     const PacketTiming *packets, size_t packet_count);
+        // 转码完成后删除检查点文件
+        void remove();
+};
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef VIDEO_GOP_CACHE_H
+#define VIDEO_GOP_CACHE_H
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "video_writer_types.h"
+
+#define GOP_CACHE_MAGIC "VWGC"
+#define GOP_CACHE_VERSION 2
+
+typedef struct {
+    uint64_t high;
+    uint64_t low;
+}GopCacheKey;
+
+// 与键一起保存，查找时核对，哈希碰撞时不会拼接尺寸或帧数不同的码流
+typedef struct {
+    uint32_t frame_count;
+    uint32_t width;
+    uint32_t height;
+    uint32_t reserved;
+}GopCacheShape;
+
+// 缓存文件格式：header | packets[packet_count] | data[data_size]
+// 包时间戳相对GOP第一帧pts
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t packet_count;
+    uint64_t data_size;
+    GopCacheShape shape;
+}GopCacheHeader;
+
+// 64位内容哈希，seed不同可得到独立的哈希值
+uint64_t content_hash(const void *data, size_t size, uint64_t seed);
+
+// 按内容寻址的已编码GOP磁盘缓存，超过容量时按最近使用时间淘汰
+class gop_cache {
+    private:
+        std::string directory;
+        uint64_t max_bytes;
+        uint64_t total_bytes = 0;
+
+        std::string path(const GopCacheKey &key);
+        uint64_t scan();
+        void evict();
+
+    public:
+        gop_cache(const std::string &directory, uint64_t max_bytes);
+
+        // 命中且shape一致时读出GOP码流与包时间
+        bool lookup(const GopCacheKey &key, const GopCacheShape &shape, std::vector<uint8_t> &data, std::vector<PacketTiming> &packets);
+        int32_t store(const GopCacheKey &key, const GopCacheShape &shape, const uint8_t *data, size_t size,
+                      const std::vector<PacketTiming> &packets);
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef VIDEO_MEMORY_BUDGET_H
+#define VIDEO_MEMORY_BUDGET_H
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+#include <vector>
+#include <utility>
+#include <functional>
+
+// 内存超出预算时的处理策略
+enum memory_policy {
+    MEMORY_POLICY_BLOCK,        // 阻塞直到其他任务释放内存
+    MEMORY_POLICY_TIMEOUT,      // 等待超时后返回AVERROR(ETIMEDOUT)
+    MEMORY_POLICY_NONBLOCK,     // 立即返回AVERROR(EAGAIN)
+};
+
+// 字节预算，统计当前与峰值用量
+// 所有预算共用一把锁，parent为进程级共享预算
+class memory_budget {
+    private:
+        memory_budget *parent;
+        bool retains;
+        size_t limit;
+        size_t usage;
+        size_t retained;
+        size_t peak;
+        memory_policy policy;
+        int64_t timeout_ms;
+
+        bool has_room(size_t bytes);
+        bool may_fit(size_t bytes);
+        int32_t wait_locked(std::unique_lock<std::mutex> &lock, size_t bytes);
+        void charge_locked(size_t bytes);
+
+        // 按排队顺序处理异步等待，放行、失败或超时的请求放入ready，在锁外回调
+        static void grant_waiters_locked(std::vector<std::pair<std::function<void(int32_t)>, int32_t> > &ready);
+        static void run_granted(std::vector<std::pair<std::function<void(int32_t)>, int32_t> > &ready);
+        static void timer_loop();
+
+    public:
+        // retains为true时用量属于常驻输出，不会因编码推进而释放
+        // 等待中的输入若只能靠常驻用量释放才能放行，将直接返回AVERROR(ENOMEM)
+        memory_budget(memory_budget *parent = nullptr, bool retains = false);
+
+        // limit为0表示不限制
+        void set_limit(size_t limit);
+        void set_policy(memory_policy policy, int64_t timeout_ms);
+
+        // 接收新数据前调用，预算不足时按策略等待
+        // 返回0表示可以继续，否则为AVERROR错误码
+        int32_t wait_for_room(size_t bytes);
+
+        // 预算足够时记录用量并返回true，不会阻塞
+        bool try_charge(size_t bytes);
+        // 按策略等待预算后记录用量，等待与记录在同一把锁内完成
+        int32_t wait_and_charge(size_t bytes);
+
+        // 不阻塞调用线程的等待，预算足够时立即计入并返回0
+        // 非阻塞策略不足时返回AVERROR(EAGAIN)，常驻用量已无法容纳时返回AVERROR(ENOMEM)
+        // 阻塞与超时策略不足时排队并返回1，之后在释放预算的线程上回调granted：
+        // 0表示已计入用量，AVERROR(ETIMEDOUT)/AVERROR(ENOMEM)/AVERROR(ECANCELED)表示未计入
+        int32_t charge_async(size_t bytes, std::function<void(int32_t)> granted);
+        // 取消本预算所有排队的异步等待
+        void cancel_waits();
+
+        // 记录实际分配与释放，不会阻塞
+        void charge(size_t bytes);
+        void release(size_t bytes);
+
+        // 用量超过自身限额时返回true
+        bool over_limit();
+
+        size_t get_usage();
+        size_t get_peak();
+        size_t get_limit();
+        memory_policy get_policy();
+
+        // 进程内所有video_writer共享的预算
+        static memory_budget *process();
+};
+
+#endif
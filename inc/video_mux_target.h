@@ -0,0 +1,55 @@
+#ifndef VIDEO_MUX_TARGET_H
+#define VIDEO_MUX_TARGET_H
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+extern "C" {
+    #include <libavformat/avformat.h>
+}
+
+#include "video_seek_index.h"
+
+// 单个封装输出，在自己的线程中写包
+// 所有输出共享引用计数的包数据，不拷贝
+class mux_target {
+    private:
+        std::string format;
+        std::string file;
+        AVFormatContext *fmt_ctx = nullptr;
+        bool own_pb = false;
+
+        std::thread worker;
+        std::deque<std::pair<AVPacket *, AVRational> > queue;
+        std::mutex mutex;
+        std::condition_variable cond;
+        bool ending = false;
+        // 写包线程未运行或已退出，由mutex保护，push不能读取worker本身
+        bool stopped = true;
+        int32_t result = 0;
+
+        seek_index_writer index{SEEK_INDEX_TIME_SCALE, 0};
+
+        void worker_loop();
+
+    public:
+        // file为空时写入调用方提供的pb
+        mux_target(const std::string &format, const std::string &file);
+        ~mux_target();
+
+        // 按顺序添加视频流与音频流并在后台写头
+        int32_t open(AVIOContext *pb, const AVCodecParameters *video_par, AVRational video_time_base,
+                     const AVCodecParameters *audio_par, AVRational audio_time_base);
+        // 引用包数据放入队列，队列满时等待，时间戳单位为time_base
+        void push(const AVPacket *pkt, AVRational time_base);
+        // 等待队列写完并写入trailer
+        int32_t finish();
+
+        const std::string &get_file();
+        int32_t write_index(const char *index_file);
+};
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef VIDEO_OVERLAY_H
+#define VIDEO_OVERLAY_H
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <memory>
+
+extern "C" {
+    #include <libavutil/frame.h>
+}
+
+#include <opencv2/core/core.hpp>
+
+// 预乘alpha的YUVA贴图，宽高为偶数
+// 色度alpha为2x2下采样后的亮度alpha
+typedef struct {
+    int width;
+    int height;
+    std::vector<uint8_t> y, u, v;
+    std::vector<uint8_t> alpha, alpha_uv;
+}YuvaSprite;
+
+typedef struct {
+    std::shared_ptr<YuvaSprite> sprite;
+    int x;
+    int y;
+    bool visible;
+}OverlayItem;
+
+// YUV域叠加层，水印、时间戳、字幕在颜色转换后直接混合到I420平面
+// 贴图只在设置时转换一次，每帧只处理被覆盖的像素
+class video_overlay {
+    private:
+        std::map<int, OverlayItem> items;
+        std::mutex mutex;
+
+        static std::shared_ptr<YuvaSprite> convert_sprite(const cv::Mat &image);
+        static std::shared_ptr<YuvaSprite> convert_yuva(const AVFrame *frame, bool premultiplied);
+        void put(int id, std::shared_ptr<YuvaSprite> sprite, int x, int y);
+
+    public:
+        // image为BGRA或BGR(不透明)，按id从小到大依次叠加
+        int32_t set(int id, const cv::Mat &image, int x, int y);
+        // frame为已转换好的YUVA420P，跳过颜色转换
+        // premultiplied表示Y已乘alpha/255、U/V已乘2x2平均alpha/255，与YuvaSprite相同
+        int32_t set_yuva(int id, const AVFrame *frame, int x, int y, bool premultiplied);
+        int32_t move(int id, int x, int y);
+        int32_t show(int id, bool visible);
+        void remove(int id);
+        void clear();
+        bool empty();
+
+        // 混合到YUV420P帧，frame需可写
+        void blend(AVFrame *frame);
+};
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef VIDEO_SCENE_DETECTOR_H
+#define VIDEO_SCENE_DETECTOR_H
+#include <stdint.h>
+#include <vector>
+
+// 镜头切换检测，对亮度平面8x8块均值下采样后比较直方图与SAD
+class scene_detector {
+    private:
+        double threshold;
+        int grid_width = 0;
+        int grid_height = 0;
+        std::vector<uint8_t> grid, prev_grid;
+        std::vector<uint32_t> row_sums;
+        bool has_prev = false;
+
+        void downsample(const uint8_t *luma, int linesize, int width, int height);
+
+    public:
+        // threshold为直方图差异阈值，范围0~1
+        scene_detector(double threshold);
+
+        // 与上一帧相比是否发生镜头切换
+        bool is_cut(const uint8_t *luma, int linesize, int width, int height);
+        void reset();
+};
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef VIDEO_SEEK_INDEX_H
+#define VIDEO_SEEK_INDEX_H
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// 关键帧/定位索引文件格式，按写入主机的字节序保存，可直接mmap使用
+// header.byte_order记录写入时的字节序，字节序不同的主机打开时报错
+// header | blocks[block_count] | packets[packet_count] | keyframes[keyframe_count]
+// 每SEEK_INDEX_BLOCK_SIZE个包一个block，包内时间与偏移相对block做差分
+#define SEEK_INDEX_MAGIC "VWSI"
+#define SEEK_INDEX_VERSION 2
+#define SEEK_INDEX_BYTE_ORDER 0x01020304
+#define SEEK_INDEX_BLOCK_SIZE 64
+// 视频写入时统一使用的90kHz时间单位
+#define SEEK_INDEX_TIME_SCALE 90000
+
+#define SEEK_INDEX_FLAG_KEY 1
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t time_scale;        // 时间戳单位为1/time_scale秒
+    uint32_t byte_order;        // 写入主机上的SEEK_INDEX_BYTE_ORDER
+    uint32_t reserved;
+    uint64_t packet_count;
+    uint64_t keyframe_count;
+}SeekIndexHeader;
+
+typedef struct {
+    int64_t base_dts;           // block内第一个包的dts
+    int64_t base_offset;        // block内第一个包的字节偏移
+}SeekIndexBlock;
+
+typedef struct {
+    int32_t dts_delta;          // 相对base_dts
+    int32_t pts_offset;         // pts - dts
+    uint32_t size;
+    uint32_t offset_delta;      // 相对base_offset
+    uint8_t stream;
+    uint8_t flags;
+    uint16_t reserved;
+}SeekIndexPacket;
+
+typedef struct {
+    int64_t pts;
+    uint64_t packet;            // 关键帧对应的包序号
+}SeekIndexKeyframe;
+
+// 解码后的包信息
+typedef struct {
+    int64_t pts;
+    int64_t dts;
+    int64_t offset;
+    uint32_t size;
+    int stream;
+    bool keyframe;
+}SeekIndexEntry;
+
+// GOP范围，包序号为[first_packet, end_packet)，字节为[byte_begin, byte_end)
+typedef struct {
+    uint64_t first_packet;
+    uint64_t end_packet;
+    int64_t byte_begin;
+    int64_t byte_end;
+    int64_t start_pts;
+}SeekIndexRange;
+
+// 在写包时记录索引，写出时生成索引文件
+class seek_index_writer {
+    private:
+        uint32_t time_scale;
+        int key_stream;
+        std::vector<SeekIndexBlock> blocks;
+        std::vector<SeekIndexPacket> packets;
+        std::vector<SeekIndexKeyframe> keyframes;
+
+    public:
+        // key_stream为建立关键帧表的流，通常为视频流
+        seek_index_writer(uint32_t time_scale, int key_stream);
+
+        // 时间戳单位为1/time_scale，offset需按写入顺序递增
+        void add(int stream, int64_t pts, int64_t dts, uint32_t size, int64_t offset, bool keyframe);
+        void clear();
+        size_t size();
+        int32_t write(const char *output_file);
+};
+
+// mmap索引文件，无需解析即可O(log n)定位
+class seek_index {
+    private:
+        void *mapping = nullptr;
+        size_t mapping_size = 0;
+        const SeekIndexHeader *header = nullptr;
+        const SeekIndexBlock *blocks = nullptr;
+        const SeekIndexPacket *packets = nullptr;
+        const SeekIndexKeyframe *keyframes = nullptr;
+
+    public:
+        seek_index();
+        ~seek_index();
+
+        int32_t open(const char *index_file);
+        void close();
+
+        uint32_t time_scale();
+        uint64_t packet_count();
+        uint64_t keyframe_count();
+        int32_t packet(uint64_t index, SeekIndexEntry *entry);
+
+        // pts不大于time的最后一个关键帧序号，没有时返回-1
+        int64_t find_keyframe(int64_t time);
+        // time所在GOP的包与字节范围
+        int32_t gop_range(int64_t time, SeekIndexRange *range);
+};
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef VIDEO_THUMBNAILER_H
+#define VIDEO_THUMBNAILER_H
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+extern "C" {
+    #include <libavutil/frame.h>
+}
+
+#include <opencv2/core/core.hpp>
+
+// 缩略图采样方式
+enum thumbnail_mode {
+    THUMBNAIL_INTERVAL,     // 每隔interval帧采样
+    THUMBNAIL_KEYFRAME,     // 在关键帧采样
+};
+
+typedef struct {
+    thumbnail_mode mode;
+    int interval;
+    cv::Size thumb_size;        // 单张缩略图尺寸
+    int columns;                // sprite sheet每行缩略图数
+    int rows;                   // sprite sheet每列缩略图数
+    // 输出<prefix>_0001.jpg缩略图、<prefix>_sheet_0001.jpg拼图和<prefix>.json时间清单
+    std::string output_prefix;
+    size_t max_pending;         // 后台队列上限，超出时丢弃采样，不阻塞编码
+}ThumbnailConfig;
+
+typedef struct {
+    double time;                // 秒
+    int sheet;
+    int x;
+    int y;
+}ThumbnailEntry;
+
+// 从颜色转换后的YUV帧生成缩略图和sprite sheet，缩放与写文件都在后台线程
+class video_thumbnailer {
+    private:
+        ThumbnailConfig config;
+        std::thread worker;
+        std::deque<std::pair<AVFrame *, double> > pending;
+        std::mutex mutex;
+        std::condition_variable cond;
+        bool finishing = false;
+        bool finished = false;
+
+        struct SwsContext *sws_ctx = nullptr;
+        cv::Mat sheet;
+        int sheet_index = 0;
+        std::vector<ThumbnailEntry> entries;
+
+        void worker_loop();
+        void process(AVFrame *frame, double time);
+        void write_sheet();
+        void write_manifest();
+
+    public:
+        video_thumbnailer(const ThumbnailConfig &config);
+        ~video_thumbnailer();
+
+        bool should_sample(int64_t frame_index, bool keyframe);
+        bool samples_keyframes();
+        // 引用frame数据放入队列，不拷贝像素
+        void push(const AVFrame *frame, double time);
+        // 等待队列处理完并写出最后的拼图与清单
+        void finish();
+};
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef VIDEO_TRACE_H
+#define VIDEO_TRACE_H
+#include <stdint.h>
+#include <atomic>
+
+// 每个线程的事件分块存放，单块事件数与单线程最多块数
+#define TRACE_CHUNK_EVENTS 4096
+#define TRACE_MAX_CHUNKS 256
+
+typedef struct {
+    const char *name;           // 需为静态字符串
+    int64_t begin;              // 纳秒，相对启用跟踪的时刻
+    int64_t end;
+    int64_t arg;                // 帧序号或pts，小于0表示无
+}TraceEvent;
+
+// 进程内流水线耗时跟踪，导出Chrome trace-event JSON，可用chrome://tracing或Perfetto查看
+// 每个线程写自己的缓存，记录时不加锁；未启用时只有一次原子读
+class video_trace {
+    private:
+        static std::atomic<bool> active;
+
+    public:
+        static void enable(bool enable);
+        static bool enabled() { return active.load(std::memory_order_relaxed); }
+
+        static int64_t now();
+        // 记录一个已结束的区间
+        static void record(const char *name, int64_t begin, int64_t end, int64_t arg);
+        // 设置当前线程在跟踪文件中显示的名称，name需为静态字符串
+        // 只在线程本地保存，第一次记录事件时才创建线程缓存
+        static void set_thread_name(const char *name);
+        // 导出已记录的事件，可在记录过程中调用
+        static int32_t write(const char *trace_file);
+        // 释放已退出线程的事件缓存，之后导出不再包含这些事件
+        static void reset();
+};
+
+// 作用域区间，构造时开始，析构时结束
+class trace_span {
+    private:
+        const char *name;
+        int64_t arg;
+        int64_t begin;
+
+    public:
+        trace_span(const char *name, int64_t arg = -1) : name(name), arg(arg) {
+            begin = video_trace::enabled() ? video_trace::now() : -1;
+        }
+        ~trace_span() {
+            if(begin >= 0) {
+                video_trace::record(name, begin, video_trace::now(), arg);
+            }
+        }
+};
+
+#endif
@@ -3,6 +3,11 @@
 #include <stdint.h>
 #include <vector>
 #include <string>
+#include <future>
+#include <thread>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 
 extern "C" {
     #include <libavcodec/avcodec.h>
@@ -12,13 +17,47 @@ extern "C" {
 #include <opencv2/core/core.hpp>
 #include <opencv2/opencv.hpp>
 
+#include "video_writer_types.h"
+#include "video_memory_budget.h"
+#include "video_writer_executor.h"
+#include "video_overlay.h"
+#include "video_audio_mixer.h"
+#include "video_thumbnailer.h"
+#include "video_seek_index.h"
+#include "video_scene_detector.h"
+#include "video_gop_cache.h"
+#include "video_frame_spool.h"
+#include "video_trace.h"
+
 typedef struct {
     void *buffer;         // buffer已存储大小
     size_t size;          // buffer的容量
     size_t capacity;      // 待处理的字节索引
     size_t pos;
+    memory_budget *budget;  // 统计buffer容量的预算，可为空
 }MemoryBuffer;
 
+// 编码质量区域，qoffset范围[-1, 1]，负值提高质量，正值降低质量
+typedef struct {
+    cv::Rect rect;
+    float qoffset;
+}RoiHint;
+
+// 等待预算的异步任务，run的参数为预算等待结果，非0时不执行任务直接回调
+typedef struct {
+    size_t pending_bytes;
+    std::function<void(int32_t)> run;
+}ParkedTask;
+
+// 额外的封装输出
+typedef struct {
+    std::string format;     // 封装格式，如matroska、mpegts
+    std::string file;       // 输出文件
+}OutputTarget;
+
+class mux_target;
+class audio_file_map;
+
 class video_writer {
     private:
         int STREAM_FRAME_RATE;
@@ -30,15 +69,92 @@ class video_writer {
         //编码器尺寸，默认Size(1280, 720)
         cv::Size frame_size;
 
+        // 颜色转换后在YUV域混合的叠加层
+        video_overlay overlay;
+
+        VideoEncoderConfig encoder_config;
+
+        // 自适应关键帧，在镜头切换处强制IDR
+        scene_detector *detector = nullptr;
+        int keyframe_min_interval = 0;
+        int keyframe_max_interval = 0;
+        int64_t frames_since_keyframe = 0;
+
+        // 增量重渲染缓存，按帧内容哈希复用已编码的封闭GOP
+        // GOP边界由帧内容决定，插入或删除帧后只有附近的GOP需要重新编码
+        gop_cache *render_cache = nullptr;
+        std::vector<AVFrame *> pending_gop;
+        std::vector<GopCacheKey> pending_gop_hashes;
+        size_t pending_gop_bytes = 0;
+        uint64_t cache_hits = 0;
+        uint64_t cache_misses = 0;
+
+        // 运行时跟不上帧率时逐级切换到更快的preset
+        bool realtime_step_down = false;
+        double frame_seconds_average = 0;
+        int64_t frames_since_step = 0;
+
+        // 快速采集模式下的YUV磁盘缓存，启用后不再编码视频
+        frame_spool_writer *spool = nullptr;
+        // 后台转码线程，析构时等待结束
+        std::thread transcode_worker;
+
+        // 从转换后的帧生成缩略图，启用后创建
+        video_thumbnailer *thumbnailer = nullptr;
+        int64_t video_frame_count = 0;
+
         AVBufferRef *hw_device_ctx= nullptr;
 
+        // 内存预算，覆盖等待编码的输入帧、PCM与待编码GOP，编码后即释放
+        memory_budget budget{memory_budget::process()};
+        // 编码包、mux输出等常驻缓冲，直到writer析构才释放，计入进程预算
+        // 输出只增不减，超过自身限额时输入直接失败；进程预算被常驻输出占满时等待中的输入也直接失败，不会永久阻塞
+        memory_budget output_budget{memory_budget::process(), true};
+
+        // 异步任务按提交顺序串行执行
+        writer_strand strand{writer_executor::instance()};
+        // 等待预算的任务及其后提交的任务，按提交顺序暂存，不占用线程池的线程
+        // 预算释放时由释放预算的线程投递到strand
+        std::mutex parked_mutex;
+        std::condition_variable parked_cond;
+        std::deque<ParkedTask> parked_tasks;
+        bool closing = false;
+        // 当前异步任务的输入已在submit中计入预算，执行时不再重复等待
+        bool input_prepaid = false;
+
         // 输入音频数据存储
         MemoryBuffer *audio_buffer_to_encoder;
         size_t audio_buffer_handled = 0;
+        size_t pcm_charged = 0;
+
+        // 多轨混音，添加第一个轨道时创建
+        audio_mixer *mixer = nullptr;
+        size_t mixer_charged = 0;
 
-        size_t frame_pts = 0;
+        // 视频时间戳，单位为video_time_base
+        // frame_pts为下一帧默认pts，last_video_pts/last_video_duration为上一帧的时间
+        AVRational video_time_base;
+        int64_t frame_pts = 0;
+        int64_t last_video_pts = AV_NOPTS_VALUE;
+        int64_t last_video_duration = 0;
+        // 已编码视频包的时间戳，按输出顺序记录，mux时还原可变帧率时间
+        std::vector<PacketTiming> video_packet_timings;
+        // 跟踪启用时记录送入编码器的帧pts与时间
+        std::deque<std::pair<int64_t, int64_t> > trace_send_times;
+
+        // h264、aac裸流与各封装输出的定位索引，写文件时生成<file>.vwsi
+        bool seek_index_enabled = false;
+        seek_index_writer h264_index{SEEK_INDEX_TIME_SCALE, 0};
+        seek_index_writer aac_index{SEEK_INDEX_TIME_SCALE, 0};
+        // 已送入编码器的音频采样数，作为音频帧pts
+        int64_t audio_sample_pts = 0;
 
         AVFrame *video_frame = nullptr;
+        // 上一帧转换后的YUV引用，输入变化区域时复用
+        // 丢帧时释放，下一帧按整帧转换，避免调用方的变化区域丢失
+        AVFrame *previous_frame = nullptr;
+        // 上一帧混合过叠加层，移除叠加层后的第一帧需整帧转换
+        bool previous_blended = false;
         AVFrame *audio_frame = nullptr;
         AVPacket *video_pkt, *audio_pkt;
         const AVCodec *video_codec = nullptr;
@@ -53,25 +169,71 @@ class video_writer {
         unsigned char *audio_aviobuffer;
         unsigned char *mux_aviobuffer;
 
-        AVFormatContext *video_fmt_ctx = nullptr, *audio_fmt_ctx = nullptr, *output_fmt_ctx = nullptr;
+        AVFormatContext *video_fmt_ctx = nullptr, *audio_fmt_ctx = nullptr;
+        // 封装输出，第一个为写入内存的MP4，其余为add_output添加的文件
+        std::vector<OutputTarget> extra_outputs;
+        std::vector<mux_target *> mux_targets;
         AVPacket muxer_pkt;
         int32_t in_video_st_idx = -1, in_audio_st_idx = -1;
         int32_t out_video_st_idx = -1, out_audio_st_idx = -1;
 
-        int32_t cvmat_to_avframe(cv::Mat &inMat);
+        // dirty_rects不为空指针时只转换其中的区域，其余复用上一帧
+        int32_t cvmat_to_avframe(cv::Mat &inMat, int64_t pts, int64_t duration,
+                                 const std::vector<cv::Rect> *dirty_rects = nullptr, const std::vector<RoiHint> *rois = nullptr);
+        int32_t convert_video_frame(cv::Mat &inMat, int64_t pts, int64_t duration,
+                                    const std::vector<cv::Rect> *dirty_rects, const std::vector<RoiHint> *rois);
+        // 编码输出超过限额时返回AVERROR(ENOMEM)
+        int32_t check_output_limit();
+        // 为video_frame添加AV_FRAME_DATA_REGIONS_OF_INTEREST
+        int32_t attach_roi(const std::vector<RoiHint> &rois);
         int32_t writer_frame_to_yuv();
-        int32_t encoder_yuv_to_h264(bool flushing);
+        // 平均每帧耗时超过帧间隔时切换preset，重建编码器失败时返回错误码
+        int32_t check_realtime();
+        // 对video_frame执行关键帧决策、缩略图采样与编码
+        int32_t encode_video_frame(int64_t pts, int64_t duration);
+        // frame为nullptr时刷新编码器
+        int32_t encoder_yuv_to_h264(AVFrame *frame);
         int32_t encoder_pcm_to_aac(bool flushing);
         //void get_adts_header(AVCodecContext* ctx, uint8_t *adts_header, int aac_length);
         int32_t muxing();
+        // 音频文件格式与编码器一致时直接从映射编码，否则分块重采样后输入
+        int32_t input_mapped_audio(audio_file_map &file);
+        int32_t input_converted_audio(audio_file_map &file);
+        // 混合已就绪的音频帧并送入AAC编码器
+        int32_t encode_mixed_audio(bool drain);
+        // 将未满一帧的PCM长度同步到内存预算
+        void sync_pcm_charge();
 
         int32_t init_video_encoder();
+        // 按当前参数重新打开视频编码器
+        int32_t reset_video_encoder();
+        // 决定当前帧是否为关键帧并设置pict_type强制编码器输出，缓存模式下关键帧由GOP边界决定
+        bool place_keyframe();
+        // 影响编码结果的参数，作为GOP缓存键的一部分
+        std::string encoder_settings_key();
+        // 缓存模式下暂存帧，满一个GOP后查缓存或编码
+        int32_t cache_video_frame();
+        int32_t encode_cached_gop();
+        // 检查点的编码参数标识，包括关键帧方式与GOP缓存
+        std::string transcode_settings_key();
+        // 从检查点恢复已编码的码流、包时间与时间戳状态
+        void restore_transcode(const TranscodeCheckpoint &state, const std::vector<uint8_t> &video,
+                               const std::vector<PacketTiming> &packets);
+        // 按GOP编码输出包的关键帧标记采样缩略图
+        void sample_gop_keyframes(const std::vector<PacketTiming> &packets, int64_t base_pts);
         int32_t init_audio_encoder();
         int32_t init_input_video();
         int32_t init_input_audio();
         int32_t init_output();
         int32_t init();
 
+        // 提交异步任务，pending_bytes计入内存预算直到任务完成
+        std::future<int32_t> submit(std::function<int32_t()> task, size_t pending_bytes, writer_callback callback);
+        // 需持有parked_mutex，预算不足时暂存到队首并返回false
+        bool dispatch_locked(const ParkedTask &parked);
+        // 队首任务的预算等待结束，投递它及其后不需等待的任务
+        void resume_parked(int32_t result);
+
 
 
 
@@ -88,8 +250,35 @@ class video_writer {
 
         // 输入帧Mat数据
         int32_t input_image(cv::Mat png_image);
+        // 输入帧Mat数据并给出相对上一次输入变化的区域，未变化区域直接复用上一帧的YUV
+        // dirty_rects为空表示画面未变化；有叠加层时仍按整帧转换
+        // rois作为AV_FRAME_DATA_REGIONS_OF_INTEREST传给编码器，libx264按区域调整量化
+        int32_t input_image_regions(cv::Mat png_image, const std::vector<cv::Rect> &dirty_rects,
+                                    const std::vector<RoiHint> &rois = std::vector<RoiHint>());
+        // 输入整帧并附带质量区域
+        int32_t input_image_roi(cv::Mat png_image, const std::vector<RoiHint> &rois);
+        // 输入带时间戳的帧Mat数据，pts单位为time_base，需严格递增
+        int32_t input_image(cv::Mat png_image, int64_t pts, AVRational time_base);
+        // 输入帧Mat数据并指定显示时长，duration单位为time_base，下一帧紧接其后
+        int32_t input_image_duration(cv::Mat png_image, int64_t duration, AVRational time_base);
         // 输入音频char *数据
         int32_t input_audio(char *audio_data, size_t size);
+        // mmap输入PCM或WAV文件，WAV按RIFF头的格式、采样率与声道数重采样
+        // 裸PCM格式与input_audio相同，此时直接从映射逐帧编码，不拷贝整个文件
+        int32_t input_audio_file(const char *audio_file);
+
+        // 多轨音频输入，各轨道独立重采样后混合，不要与input_audio同时使用
+        // 添加轨道，sample_fmt需为交错格式
+        int32_t add_audio_track(const std::string &name, int sample_rate, int channels, AVSampleFormat sample_fmt);
+        int32_t input_audio_track(const std::string &name, const char *audio_data, size_t size);
+        // 在ramp_ms毫秒内线性渐变到gain
+        int32_t set_audio_track_gain(const std::string &name, float gain, int ramp_ms = 0);
+        // 结束轨道，所有轨道结束后剩余数据补静音编码完
+        int32_t end_audio_track(const std::string &name);
+
+        // 添加额外的封装输出，需在video_mux之前调用
+        // video_mux时每个包只读取一次，同时写入内存MP4与所有额外输出
+        int32_t add_output(const std::string &format, const std::string &file);
 
         // 执行mux操作
         int32_t video_mux();
@@ -101,9 +290,101 @@ class video_writer {
         // 输出MP4音视频文件
         int32_t write_video(char *output_file);
 
+        // 设置叠加层，image为BGRA或BGR，按id从小到大叠加到之后输入的每一帧
+        // 贴图只在设置时转换一次，之后可逐帧移动或显示/隐藏
+        int32_t set_overlay(int id, const cv::Mat &image, int x, int y);
+        // 预先转换好的YUVA420P贴图，省去BGR到YUV的转换
+        int32_t set_overlay_yuva(int id, const AVFrame *frame, int x, int y, bool premultiplied);
+        int32_t move_overlay(int id, int x, int y);
+        int32_t show_overlay(int id, bool visible);
+        void remove_overlay(int id);
+        void clear_overlays();
+
+        // 设置视频编码参数，需在输入第一帧之前调用
+        int32_t set_video_encoder_config(const VideoEncoderConfig &config);
+        VideoEncoderConfig get_video_encoder_config();
+        // 在本机用合成画面测量编码速度，从当前preset开始逐级变快
+        // 选择能达到帧率 * margin的最高质量preset与最少线程数，需在输入第一帧之前调用
+        // 结果按主机、分辨率与编码参数缓存在cache_directory，返回1表示没有组合能达到目标
+        int32_t calibrate_video_encoder(const std::string &cache_directory, double margin = 1.2);
+        // 运行时平均每帧转换与编码耗时超过帧间隔时，切换到下一级更快的preset
+        // 切换处刷新编码器并从IDR开始，每次切换后至少观察1秒
+        // 开启时固定写入SPS/PPS的编码参数，使各preset的码流头一致，需在输入第一帧之前开启
+        int32_t set_realtime_step_down(bool enable);
+        // 自适应关键帧，在检测到的镜头切换处强制IDR，关键帧间隔限制在[min_interval, max_interval]帧
+        // 需在输入第一帧之前调用，threshold越小越容易判定为切换
+        int32_t set_adaptive_keyframes(int min_interval, int max_interval, double threshold = 0.35);
+
+        // 快速采集模式，需在输入第一帧之前调用
+        // 颜色转换和叠加后的YUV帧与PCM直接mmap写入directory，不经过编码器，flush结束采集
+        int32_t enable_capture_spool(const std::string &directory);
+        // 将采集缓存转码为output_file，writer需以最终编码参数新建，帧率尺寸与采集时一致
+        // 约每TRANSCODE_CHECKPOINT_SECONDS秒在GOP边界刷新编码器并在directory中保存检查点
+        // 中断后用相同编码参数的新writer再次调用时从最后一个检查点继续，成功写出后删除检查点
+        // 继续转码时已完成部分不再生成缩略图
+        int32_t transcode_spool(const std::string &directory, const char *output_file, spool_progress_callback progress = nullptr);
+        // 在低优先级后台线程中转码，完成前不要调用该writer的其他接口
+        // 同一writer只能调用一次，再次调用立即以-1完成
+        std::future<int32_t> transcode_spool_async(const std::string &directory, const char *output_file,
+                                                   spool_progress_callback progress = nullptr, writer_callback callback = nullptr);
+
+        // 启用增量重渲染缓存，需在输入第一帧之前调用，不能与自适应关键帧同时使用
+        // 按帧内容切分为平均gop_size帧的封闭GOP，帧内容与编码参数都未变化的GOP直接拼接缓存码流
+        // 每个GOP使用新的编码器实例，码率控制按GOP独立进行，不能在GOP之间分配码率
+        // 缓存目录超过max_bytes时按最近使用时间淘汰
+        int32_t enable_gop_cache(const std::string &directory, uint64_t max_bytes);
+        // 复用与重新编码的GOP数量
+        uint64_t gop_cache_hits();
+        uint64_t gop_cache_misses();
+
+        // 编码的同时在后台生成缩略图、sprite sheet和时间清单
+        int32_t enable_thumbnails(const ThumbnailConfig &config);
+        // 等待缩略图全部写出，析构时也会自动调用
+        void finish_thumbnails();
+
+        // 写h264/aac/MP4文件时同时输出<file>.vwsi定位索引，可用seek_index读取
+        void enable_seek_index(bool enable);
+
+        // 设置内存预算，limit为0表示不限制
+        // 超出预算时input_image/input_audio按policy阻塞、超时或返回AVERROR(EAGAIN)
+        void set_memory_budget(size_t limit, memory_policy policy, int64_t timeout_ms = 0);
+        // 设置进程内所有video_writer共享的内存预算
+        static void set_process_memory_budget(size_t limit);
+        // 当前与峰值内存用量（字节），只包含受预算限制的输入数据
+        size_t memory_usage();
+        size_t memory_peak();
+        // 编码输出缓冲的限额（字节），0表示只受进程预算限制
+        // 超过后输入接口返回AVERROR(ENOMEM)，输出缓冲同时计入进程预算
+        void set_output_memory_limit(size_t limit);
+        // 编码输出缓冲占用的内存（字节）
+        size_t output_memory_usage();
+        static size_t process_memory_usage();
+        static size_t process_memory_peak();
+
+        // 进程内所有writer的流水线耗时跟踪，记录转换、编码、混流、写文件等每帧区间
+        // 未启用时开销可忽略，write_trace导出Chrome trace-event JSON
+        static void enable_tracing(bool enable);
+        static int32_t write_trace(const char *trace_file);
+        // 释放已退出线程的跟踪缓存，长时间运行时在导出后调用
+        static void reset_trace();
+
         // 刷新编码器，表示输入流的结束
         // 如未刷新编码器可能会有packet残留，输出视频不完整
-        void flush();
+        // 返回0表示成功，否则为编码器或缓存的错误码
+        int32_t flush();
+
+        // 异步接口，不阻塞调用线程，返回future并可选完成回调
+        // 任务在共享线程池中按提交顺序执行，异步任务完成前不要再调用同步接口
+        // Mat不会被拷贝，任务完成前调用方不能修改其数据
+        // 预算不足时既不阻塞调用线程也不占用线程池：非阻塞策略的拒绝经线程池回调，
+        // 阻塞与超时策略的任务暂存到预算释放或超时，writer析构时仍在等待的任务返回AVERROR(ECANCELED)
+        std::future<int32_t> input_image_async(cv::Mat png_image, writer_callback callback = nullptr);
+        std::future<int32_t> input_image_async(cv::Mat png_image, int64_t pts, AVRational time_base, writer_callback callback = nullptr);
+        // 音频数据会被拷贝
+        std::future<int32_t> input_audio_async(const char *audio_data, size_t size, writer_callback callback = nullptr);
+        std::future<int32_t> flush_async(writer_callback callback = nullptr);
+        std::future<int32_t> video_mux_async(writer_callback callback = nullptr);
+        std::future<int32_t> write_video_async(const char *output_file, writer_callback callback = nullptr);
 
         ~video_writer();
 };
@@ -0,0 +1,54 @@
+#ifndef VIDEO_WRITER_EXECUTOR_H
+#define VIDEO_WRITER_EXECUTOR_H
+#include <stdint.h>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+
+// 异步任务完成回调，参数为任务返回值
+typedef std::function<void(int32_t)> writer_callback;
+
+// 进程内共享的工作线程池，所有video_writer的异步任务都在这里执行
+class writer_executor {
+    private:
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()>> tasks;
+        std::mutex mutex;
+        std::condition_variable cond;
+        bool stopping = false;
+
+        void worker_loop();
+
+    public:
+        writer_executor(size_t thread_count);
+        ~writer_executor();
+
+        void post(std::function<void()> task);
+
+        static writer_executor *instance();
+};
+
+// 同一writer的任务串行执行，按提交顺序在线程池中运行
+// 上百个writer只占用线程池的线程，不需要每个任务一个线程
+class writer_strand {
+    private:
+        writer_executor *executor;
+        std::deque<std::function<void()>> tasks;
+        std::mutex mutex;
+        std::condition_variable idle_cond;
+        bool running = false;
+
+        void run_one();
+
+    public:
+        writer_strand(writer_executor *executor);
+
+        void post(std::function<void()> task);
+        // 等待已提交的任务全部完成
+        void wait_idle();
+};
+
+#endif
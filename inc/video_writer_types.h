@@ -0,0 +1,31 @@
+#ifndef VIDEO_WRITER_TYPES_H
+#define VIDEO_WRITER_TYPES_H
+#include <stdint.h>
+#include <string>
+
+typedef struct {
+    int64_t pts;          // 显示时间戳，单位为编码器时间基
+    int64_t dts;          // 解码时间戳
+    int64_t duration;     // 持续时长
+    int32_t size;         // 包字节数
+    int32_t flags;        // AV_PKT_FLAG_*
+}PacketTiming;
+
+// 视频编码参数，默认值与writer初始设置一致
+typedef struct VideoEncoderConfig {
+    std::string preset = "slow";    // x264 preset
+    int64_t bit_rate = 2000000;     // 输出码率，crf大于0时不使用
+    int gop_size = 10;              // 关键帧间隔
+    int max_b_frames = 3;
+    int crf = 0;                    // 恒定质量模式，0表示按bit_rate编码
+    int thread_count = 0;           // 编码线程数，0表示自动
+}VideoEncoderConfig;
+
+// 自适应关键帧设置，adaptive为false时按gop_size固定间隔
+typedef struct {
+    bool adaptive;
+    int min_interval;
+    int max_interval;
+}KeyframeConfig;
+
+#endif
@@ -0,0 +1,168 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+
+#include "video_audio_file.h"
+
+// WAV格式码
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+
+static uint16_t read_le16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t read_le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+audio_file_map::~audio_file_map() {
+    close();
+}
+
+int32_t audio_file_map::open(const char *audio_file, int sample_rate, int channels, AVSampleFormat sample_fmt) {
+    close();
+
+    int fd = ::open(audio_file, O_RDONLY);
+    if(fd < 0) {
+        std::cerr << "Error: could not open audio file " << audio_file << std::endl;
+        return -1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size == 0) {
+        std::cerr << "Error: audio file " << audio_file << " is empty." << std::endl;
+        ::close(fd);
+        return -1;
+    }
+
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(map == MAP_FAILED) {
+        std::cerr << "Error: mmap audio file " << audio_file << " failed." << std::endl;
+        return -1;
+    }
+    mapping = (uint8_t *)map;
+    mapping_size = st.st_size;
+    // 只顺序读取一遍，提示内核积极预读并尽早回收
+    madvise(mapping, mapping_size, MADV_SEQUENTIAL);
+
+    if(mapping_size >= 12 && memcmp(mapping, "RIFF", 4) == 0 && memcmp(mapping + 8, "WAVE", 4) == 0) {
+        if(parse_wav() < 0) {
+            std::cerr << "Error: unsupported wav file " << audio_file << std::endl;
+            close();
+            return -1;
+        }
+        return 0;
+    }
+
+    samples = mapping;
+    samples_size = mapping_size;
+    parsed_sample_rate = sample_rate;
+    parsed_channels = channels;
+    parsed_sample_fmt = sample_fmt;
+    return 0;
+}
+
+int32_t audio_file_map::parse_wav() {
+    bool has_format = false;
+    size_t offset = 12;
+    while(offset + 8 <= mapping_size) {
+        const uint8_t *chunk = mapping + offset;
+        uint32_t chunk_size = read_le32(chunk + 4);
+        const uint8_t *body = chunk + 8;
+        size_t available = mapping_size - offset - 8;
+
+        if(memcmp(chunk, "fmt ", 4) == 0 && chunk_size >= 16 && available >= 16) {
+            uint16_t format = read_le16(body);
+            parsed_channels = read_le16(body + 2);
+            parsed_sample_rate = read_le32(body + 4);
+            uint16_t bits = read_le16(body + 14);
+            // 扩展格式的子格式GUID前两个字节为实际格式码
+            if(format == WAVE_FORMAT_EXTENSIBLE && chunk_size >= 40 && available >= 40) {
+                format = read_le16(body + 24);
+            }
+
+            if(format == WAVE_FORMAT_PCM && bits == 8) {
+                parsed_sample_fmt = AV_SAMPLE_FMT_U8;
+            }
+            else if(format == WAVE_FORMAT_PCM && bits == 16) {
+                parsed_sample_fmt = AV_SAMPLE_FMT_S16;
+            }
+            else if(format == WAVE_FORMAT_PCM && bits == 32) {
+                parsed_sample_fmt = AV_SAMPLE_FMT_S32;
+            }
+            else if(format == WAVE_FORMAT_IEEE_FLOAT && bits == 32) {
+                parsed_sample_fmt = AV_SAMPLE_FMT_FLT;
+            }
+            else if(format == WAVE_FORMAT_IEEE_FLOAT && bits == 64) {
+                parsed_sample_fmt = AV_SAMPLE_FMT_DBL;
+            }
+            else {
+                std::cerr << "Error: wav format " << format << " with " << bits << " bits is not supported." << std::endl;
+                return -1;
+            }
+            has_format = parsed_channels > 0 && parsed_sample_rate > 0;
+        }
+        else if(memcmp(chunk, "data", 4) == 0) {
+            if(!has_format) {
+                return -1;
+            }
+            // 录制中断的文件data长度可能未回填，按文件实际长度截断
+            samples = body;
+            samples_size = chunk_size < available ? chunk_size : available;
+            size_t frame_bytes = parsed_channels * av_get_bytes_per_sample(parsed_sample_fmt);
+            samples_size -= samples_size % frame_bytes;
+            return 0;
+        }
+
+        // chunk按2字节对齐
+        offset += 8 + (size_t)chunk_size + (chunk_size & 1);
+    }
+    return -1;
+}
+
+void audio_file_map::close() {
+    if(mapping) {
+        munmap(mapping, mapping_size);
+    }
+    mapping = nullptr;
+    mapping_size = 0;
+    samples = nullptr;
+    samples_size = 0;
+    released = 0;
+}
+
+void audio_file_map::release(size_t offset) {
+    // 只释放完整的页，offset为samples内的偏移
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t end = (samples - mapping + offset) / page * page;
+    if(end > released) {
+        madvise(mapping + released, end - released, MADV_DONTNEED);
+        released = end;
+    }
+}
+
+const uint8_t *audio_file_map::data() {
+    return samples;
+}
+
+size_t audio_file_map::size() {
+    return samples_size;
+}
+
+int audio_file_map::sample_rate() {
+    return parsed_sample_rate;
+}
+
+int audio_file_map::channels() {
+    return parsed_channels;
+}
+
+AVSampleFormat audio_file_map::sample_fmt() {
+    return parsed_sample_fmt;
+}
@@ -0,0 +1,257 @@
+#include <string.h>
+#include <iostream>
+#include <algorithm>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "video_audio_mixer.h"
+
+// dst += src * gain
+static void mix_add(float *dst, const float *src, float gain, int n) {
+    int i = 0;
+#ifdef __SSE__
+    const __m128 g = _mm_set1_ps(gain);
+    for(; i + 4 <= n; i += 4) {
+        __m128 d = _mm_loadu_ps(dst + i);
+        __m128 s = _mm_loadu_ps(src + i);
+        _mm_storeu_ps(dst + i, _mm_add_ps(d, _mm_mul_ps(s, g)));
+    }
+#endif
+    for(; i < n; i++) {
+        dst[i] += src[i] * gain;
+    }
+}
+
+audio_mixer::audio_mixer(int sample_rate, int channels, uint64_t channel_layout) {
+    this->sample_rate = sample_rate;
+    this->channels = channels;
+    this->channel_layout = channel_layout;
+    max_lag = sample_rate;
+    convert_planes.resize(channels);
+}
+
+audio_mixer::~audio_mixer() {
+    for(std::map<std::string, AudioTrack>::iterator it = tracks.begin(); it != tracks.end(); ++it) {
+        swr_free(&it->second.swr);
+        av_audio_fifo_free(it->second.fifo);
+    }
+}
+
+AudioTrack *audio_mixer::find(const std::string &name) {
+    std::map<std::string, AudioTrack>::iterator it = tracks.find(name);
+    if(it == tracks.end()) {
+        std::cerr << "Error: audio track " << name << " not found." << std::endl;
+        return nullptr;
+    }
+    return &it->second;
+}
+
+int32_t audio_mixer::add_track(const std::string &name, int sample_rate, int channels, enum AVSampleFormat sample_fmt) {
+    if(tracks.count(name)) {
+        std::cerr << "Error: audio track " << name << " already exists." << std::endl;
+        return -1;
+    }
+    if(av_sample_fmt_is_planar(sample_fmt)) {
+        std::cerr << "Error: audio track " << name << " must use an interleaved sample format." << std::endl;
+        return -1;
+    }
+
+    AudioTrack track;
+    track.swr = swr_alloc_set_opts(nullptr, channel_layout, AV_SAMPLE_FMT_FLTP, this->sample_rate,
+                                   av_get_default_channel_layout(channels), sample_fmt, sample_rate, 0, nullptr);
+    if(!track.swr || swr_init(track.swr) < 0) {
+        std::cerr << "Error: could not init resampler for audio track " << name << "." << std::endl;
+        swr_free(&track.swr);
+        return -1;
+    }
+
+    track.fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_FLTP, this->channels, 1);
+    if(!track.fifo) {
+        std::cerr << "Error: could not alloc fifo for audio track " << name << "." << std::endl;
+        swr_free(&track.swr);
+        return -1;
+    }
+
+    track.channels = channels;
+    track.sample_fmt = sample_fmt;
+    track.gain = 1.0f;
+    track.gain_step = 0.0f;
+    track.ramp_samples = 0;
+    track.position = mixed_samples;
+    track.ended = false;
+    tracks[name] = track;
+    return 0;
+}
+
+int32_t audio_mixer::push_converted(AudioTrack &track, const uint8_t **data, int nb_samples) {
+    int out_samples = swr_get_out_samples(track.swr, nb_samples);
+    if(out_samples <= 0) {
+        return 0;
+    }
+
+    uint8_t *out[AV_NUM_DATA_POINTERS];
+    for(int ch = 0; ch < channels; ch++) {
+        if((int)convert_planes[ch].size() < out_samples) {
+            convert_planes[ch].resize(out_samples);
+        }
+        out[ch] = (uint8_t *)convert_planes[ch].data();
+    }
+
+    int converted = swr_convert(track.swr, out, out_samples, data, nb_samples);
+    if(converted < 0) {
+        std::cerr << "Error: swr_convert failed." << std::endl;
+        return converted;
+    }
+    if(converted > 0 && av_audio_fifo_write(track.fifo, (void **)out, converted) < converted) {
+        std::cerr << "Error: audio fifo write failed." << std::endl;
+        return -1;
+    }
+    return converted;
+}
+
+int32_t audio_mixer::write(const std::string &name, const uint8_t *data, size_t size) {
+    AudioTrack *track = find(name);
+    if(!track) {
+        return -1;
+    }
+    if(track->ended) {
+        std::cerr << "Error: audio track " << name << " already ended." << std::endl;
+        return -1;
+    }
+
+    int nb_samples = size / (track->channels * av_get_bytes_per_sample(track->sample_fmt));
+    const uint8_t *in[1] = {data};
+    int32_t result = push_converted(*track, in, nb_samples);
+    return result < 0 ? result : 0;
+}
+
+int32_t audio_mixer::set_gain(const std::string &name, float gain, int ramp_samples) {
+    AudioTrack *track = find(name);
+    if(!track) {
+        return -1;
+    }
+
+    if(ramp_samples <= 0) {
+        track->gain = gain;
+        track->gain_step = 0.0f;
+        track->ramp_samples = 0;
+    }
+    else {
+        track->gain_step = (gain - track->gain) / ramp_samples;
+        track->ramp_samples = ramp_samples;
+    }
+    return 0;
+}
+
+int32_t audio_mixer::end_track(const std::string &name) {
+    AudioTrack *track = find(name);
+    if(!track) {
+        return -1;
+    }
+    if(track->ended) {
+        return 0;
+    }
+
+    // 取出重采样器中的剩余数据
+    int32_t result = push_converted(*track, nullptr, 0);
+    track->ended = true;
+    return result < 0 ? result : 0;
+}
+
+// 欠载时补过静音的轨道，迟到的数据对应已输出的时间段，丢弃以免整条轨道后移
+void audio_mixer::drop_late(AudioTrack &track) {
+    int late = (int)std::min<int64_t>(mixed_samples - track.position, av_audio_fifo_size(track.fifo));
+    if(late > 0) {
+        av_audio_fifo_drain(track.fifo, late);
+        track.position += late;
+    }
+}
+
+bool audio_mixer::mix_frame(AVFrame *frame, bool drain) {
+    int nb_samples = frame->nb_samples;
+    if(tracks.empty()) {
+        return false;
+    }
+
+    for(std::map<std::string, AudioTrack>::iterator it = tracks.begin(); it != tracks.end(); ++it) {
+        drop_late(it->second);
+    }
+
+    int max_buffered = 0;
+    for(std::map<std::string, AudioTrack>::iterator it = tracks.begin(); it != tracks.end(); ++it) {
+        max_buffered = std::max(max_buffered, av_audio_fifo_size(it->second.fifo));
+    }
+    if(max_buffered == 0 || (!drain && max_buffered < nb_samples)) {
+        return false;
+    }
+
+    // 未结束且数据不足的轨道需等待，除非已落后太多
+    if(!drain) {
+        for(std::map<std::string, AudioTrack>::iterator it = tracks.begin(); it != tracks.end(); ++it) {
+            AudioTrack &track = it->second;
+            if(!track.ended && av_audio_fifo_size(track.fifo) < nb_samples && max_buffered < nb_samples + max_lag) {
+                return false;
+            }
+        }
+    }
+
+    for(int ch = 0; ch < channels; ch++) {
+        memset(frame->data[ch], 0, nb_samples * sizeof(float));
+    }
+
+    for(std::map<std::string, AudioTrack>::iterator it = tracks.begin(); it != tracks.end(); ++it) {
+        AudioTrack &track = it->second;
+        int available = std::min(av_audio_fifo_size(track.fifo), nb_samples);
+        if(available <= 0) {
+            continue;
+        }
+
+        for(int ch = 0; ch < channels; ch++) {
+            if((int)convert_planes[ch].size() < nb_samples) {
+                convert_planes[ch].resize(nb_samples);
+            }
+        }
+        void *planes[AV_NUM_DATA_POINTERS];
+        for(int ch = 0; ch < channels; ch++) {
+            planes[ch] = convert_planes[ch].data();
+        }
+        av_audio_fifo_read(track.fifo, planes, available);
+
+        // 渐变部分逐采样计算增益，其余部分用常量增益向量化混合
+        int ramp = std::min(track.ramp_samples, available);
+        for(int ch = 0; ch < channels; ch++) {
+            float *dst = (float *)frame->data[ch];
+            const float *src = convert_planes[ch].data();
+            float gain = track.gain;
+            for(int i = 0; i < ramp; i++) {
+                gain += track.gain_step;
+                dst[i] += src[i] * gain;
+            }
+            mix_add(dst + ramp, src + ramp, track.gain + track.gain_step * ramp, available - ramp);
+        }
+        track.gain += track.gain_step * ramp;
+        track.ramp_samples -= ramp;
+        track.position += available;
+    }
+    mixed_samples += nb_samples;
+    return true;
+}
+
+bool audio_mixer::all_ended() {
+    for(std::map<std::string, AudioTrack>::iterator it = tracks.begin(); it != tracks.end(); ++it) {
+        if(!it->second.ended) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t audio_mixer::buffered_bytes() {
+    size_t bytes = 0;
+    for(std::map<std::string, AudioTrack>::iterator it = tracks.begin(); it != tracks.end(); ++it) {
+        bytes += (size_t)av_audio_fifo_size(it->second.fifo) * channels * sizeof(float);
+    }
+    return bytes;
+}
@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+extern "C" {
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/opt.h>
+}
+
+#include <opencv2/imgproc.hpp>
+
+#include "video_encoder_calibration.h"
+#include "video_gop_cache.h"
+
+const char *const ENCODER_PRESETS[] = {"placebo", "veryslow", "slower", "slow", "medium",
+                                       "fast", "faster", "veryfast", "superfast", "ultrafast"};
+const int ENCODER_PRESET_COUNT = sizeof(ENCODER_PRESETS) / sizeof(ENCODER_PRESETS[0]);
+
+int preset_index(const std::string &preset) {
+    for(int i = 0; i < ENCODER_PRESET_COUNT; i++) {
+        if(preset == ENCODER_PRESETS[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// 主机标识：主机名、CPU型号与核数，换机器或换CPU后重新校准
+static std::string host_signature() {
+    char hostname[256] = {0};
+    gethostname(hostname, sizeof(hostname) - 1);
+    std::string signature = hostname;
+
+    FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+    if(cpuinfo != nullptr) {
+        char line[512];
+        while(fgets(line, sizeof(line), cpuinfo) != nullptr) {
+            if(strncmp(line, "model name", 10) == 0) {
+                signature += line;
+                break;
+            }
+        }
+        fclose(cpuinfo);
+    }
+
+    char cores[32];
+    snprintf(cores, sizeof(cores), "|%u", std::thread::hardware_concurrency());
+    return signature + cores;
+}
+
+// 写入SPS/PPS的参数各preset不同，切换preset后同id的参数集内容会变，与封装中的avcC不一致
+// 固定为同一组值；psy-rd在fast及更慢的preset(subme>=6)下会让x264将chroma_qp_offset减2，更快的preset直接设为-2
+static std::string fixed_header_params(const std::string &preset) {
+    bool psy_rd = preset_index(preset) <= preset_index("fast");
+    return std::string("cabac=1:ref=3:8x8dct=1:weightp=1:weightb=1:b-pyramid=normal:chroma-qp-offset=") + (psy_rd ? "0" : "-2");
+}
+
+void apply_video_encoder_config(AVCodecContext *codec_ctx, const VideoEncoderConfig &config, const KeyframeConfig &keyframes,
+                                bool fixed_headers) {
+    codec_ctx->profile = FF_PROFILE_H264_HIGH;
+    codec_ctx->bit_rate = config.crf > 0 ? 0 : config.bit_rate;    // 输出码率
+    if(config.thread_count > 0) {
+        codec_ctx->thread_count = config.thread_count;
+    }
+    codec_ctx->gop_size = config.gop_size;    // 关键帧间隔
+    codec_ctx->max_b_frames = config.max_b_frames;
+
+    std::string x264_params;
+    if(codec_ctx->codec_id == AV_CODEC_ID_H264) {
+        av_opt_set(codec_ctx->priv_data, "preset", config.preset.c_str(), 0);
+        if(config.crf > 0) {
+            av_opt_set_int(codec_ctx->priv_data, "crf", config.crf, 0);
+        }
+        if(fixed_headers) {
+            x264_params = fixed_header_params(config.preset);
+        }
+    }
+
+    // 自适应关键帧由外部决定，关闭x264自身的镜头切换检测，强制的I帧输出为IDR
+    if(keyframes.adaptive) {
+        codec_ctx->gop_size = keyframes.max_interval;
+        codec_ctx->keyint_min = keyframes.min_interval;
+        x264_params += x264_params.empty() ? "scenecut=0" : ":scenecut=0";
+        av_opt_set(codec_ctx->priv_data, "forced-idr", "1", 0);
+    }
+    if(!x264_params.empty()) {
+        av_opt_set(codec_ctx->priv_data, "x264-params", x264_params.c_str(), 0);
+    }
+}
+
+double measure_encoder_fps(const VideoEncoderConfig &config, const KeyframeConfig &keyframes, bool fixed_headers,
+                           cv::Size size, int frame_rate, AVRational time_base, int frames) {
+    const AVCodec *codec = avcodec_find_encoder_by_name("libx264");
+    if(!codec) {
+        std::cerr << "Error: could not find codec libx264." << std::endl;
+        return 0;
+    }
+
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+    AVFrame *frame = av_frame_alloc();
+    AVPacket *pkt = av_packet_alloc();
+    if(!codec_ctx || !frame || !pkt) {
+        avcodec_free_context(&codec_ctx);
+        av_frame_free(&frame);
+        av_packet_free(&pkt);
+        return 0;
+    }
+
+    // 与init_video_encoder相同的参数
+    apply_video_encoder_config(codec_ctx, config, keyframes, fixed_headers);
+    codec_ctx->width = size.width;
+    codec_ctx->height = size.height;
+    codec_ctx->time_base = time_base;
+    codec_ctx->framerate = (AVRational){frame_rate, 1};
+    codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+
+    double fps = 0;
+    frame->width = size.width;
+    frame->height = size.height;
+    frame->format = AV_PIX_FMT_YUV420P;
+    if(avcodec_open2(codec_ctx, codec, nullptr) < 0 || av_frame_get_buffer(frame, 0) < 0) {
+        std::cerr << "Error: could not open calibration encoder with preset " << config.preset << std::endl;
+        avcodec_free_context(&codec_ctx);
+        av_frame_free(&frame);
+        av_packet_free(&pkt);
+        return 0;
+    }
+
+    // 带纹理的平移BGR画面，比纯色或渐变更接近真实的运动搜索开销
+    int margin = 64;
+    cv::Mat texture(size.height + margin, size.width + margin, CV_8UC3);
+    uint32_t seed = 12345;
+    for(int y = 0; y < texture.rows; y++) {
+        uint8_t *line = texture.ptr<uint8_t>(y);
+        for(int x = 0; x < texture.cols * 3; x++) {
+            seed = seed * 1664525 + 1013904223;
+            line[x] = (uint8_t)(((x * 3 + y * 2) & 255) / 2 + (seed >> 26));
+        }
+    }
+
+    double seconds = 0;
+    int frame_size = size.width * size.height;
+    for(int i = 0; i <= frames; i++) {
+        bool flushing = i == frames;
+        cv::Mat input;
+        if(!flushing) {
+            int shift = (i * 3) % margin;
+            input = texture(cv::Rect(shift, shift / 2, size.width, size.height)).clone();
+            frame->pts = av_rescale_q(i, (AVRational){1, frame_rate}, time_base);
+        }
+
+        // 与cvmat_to_avframe相同，统计颜色转换、拷贝与编码的耗时，和运行时降级的测量一致
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if(!flushing) {
+            cv::cvtColor(input, input, cv::COLOR_BGR2YUV_I420);
+            av_frame_make_writable(frame);
+            for(int y = 0; y < size.height; y++) {
+                memcpy(frame->data[0] + y * frame->linesize[0], input.data + y * size.width, size.width);
+            }
+            for(int plane = 1; plane <= 2; plane++) {
+                const uint8_t *src = input.data + frame_size + (plane - 1) * frame_size / 4;
+                for(int y = 0; y < size.height / 2; y++) {
+                    memcpy(frame->data[plane] + y * frame->linesize[plane], src + y * size.width / 2, size.width / 2);
+                }
+            }
+        }
+        int ret = avcodec_send_frame(codec_ctx, flushing ? nullptr : frame);
+        while(ret >= 0) {
+            ret = avcodec_receive_packet(codec_ctx, pkt);
+            if(ret >= 0) {
+                av_packet_unref(pkt);
+            }
+        }
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    fps = seconds > 0 ? frames / seconds : 0;
+
+    avcodec_free_context(&codec_ctx);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    return fps;
+}
+
+int32_t calibrate_encoder(const VideoEncoderConfig &config, const KeyframeConfig &keyframes, bool fixed_headers,
+                          cv::Size size, int frame_rate, AVRational time_base, double margin,
+                          const std::string &cache_directory, CalibrationResult &result) {
+    int start = preset_index(config.preset);
+    if(start < 0) {
+        std::cerr << "Error: unknown preset " << config.preset << std::endl;
+        return -1;
+    }
+
+    // 线程数由校准决定，不计入缓存键
+    char settings[192];
+    snprintf(settings, sizeof(settings), "|%s|%lld|%d|%d|%d|%d|%d|%d|%d|%d/%d|%.3f", config.preset.c_str(),
+             (long long)(config.crf > 0 ? 0 : config.bit_rate), config.crf, config.gop_size, config.max_b_frames,
+             keyframes.adaptive ? 1 : 0, keyframes.min_interval, keyframes.max_interval, fixed_headers ? 1 : 0,
+             time_base.num, time_base.den, margin);
+    std::string signature = host_signature() + settings;
+    char name[96];
+    snprintf(name, sizeof(name), "/calibration_%016llx_%dx%d_%d.txt",
+             (unsigned long long)content_hash(signature.data(), signature.size(), 0), size.width, size.height, frame_rate);
+    std::string cache_file = cache_directory + name;
+
+    // 命中缓存时直接使用
+    FILE *input = fopen(cache_file.c_str(), "r");
+    if(input != nullptr) {
+        char preset[32];
+        int met = 0;
+        bool valid = fscanf(input, "%31s %d %lf %d", preset, &result.thread_count, &result.fps, &met) == 4
+                     && preset_index(preset) >= 0;
+        fclose(input);
+        if(valid) {
+            result.preset = preset;
+            std::cout << "Use cached calibration: preset " << result.preset << ", threads " << result.thread_count
+                      << ", " << result.fps << " fps" << std::endl;
+            return met ? 0 : 1;
+        }
+    }
+
+    // 测量1秒的画面，线程数按2的幂增加到核数
+    int frames = std::max(frame_rate, 25);
+    int cores = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<int> thread_counts;
+    for(int threads = 1; threads < cores; threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(cores);
+
+    double target = frame_rate * margin;
+    bool met = false;
+    VideoEncoderConfig trial = config;
+    for(int p = start; p < ENCODER_PRESET_COUNT && !met; p++) {
+        for(size_t t = 0; t < thread_counts.size() && !met; t++) {
+            trial.preset = ENCODER_PRESETS[p];
+            trial.thread_count = thread_counts[t];
+            double fps = measure_encoder_fps(trial, keyframes, fixed_headers, size, frame_rate, time_base, frames);
+            std::cout << "Calibration: preset " << ENCODER_PRESETS[p] << ", threads " << thread_counts[t]
+                      << ", " << fps << " fps, target " << target << std::endl;
+            // 达不到目标时保留最后测量的最快组合
+            result.preset = ENCODER_PRESETS[p];
+            result.thread_count = thread_counts[t];
+            result.fps = fps;
+            met = fps >= target;
+        }
+    }
+    if(!met) {
+        std::cerr << "Warning: no encoder setting reaches " << target << " fps on this host." << std::endl;
+    }
+
+    mkdir(cache_directory.c_str(), 0755);
+    FILE *output = fopen(cache_file.c_str(), "w");
+    if(output != nullptr) {
+        fprintf(output, "%s %d %.3f %d\n", result.preset.c_str(), result.thread_count, result.fps, met ? 1 : 0);
+        fclose(output);
+    }
+    return met ? 0 : 1;
+}
@@ -0,0 +1,440 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+
+#include "video_frame_spool.h"
+
+static size_t yuv420p_bytes(int width, int height) {
+    return (size_t)width * height + 2 * (size_t)((width + 1) / 2) * ((height + 1) / 2);
+}
+
+static std::string segment_path(const std::string &directory, int64_t index) {
+    char name[32];
+    snprintf(name, sizeof(name), "/seg_%05lld.yuv", (long long)index);
+    return directory + name;
+}
+
+// 按平面逐行拷贝，to_frame为true时从缓存拷到frame
+static void copy_planes(AVFrame *frame, uint8_t *buffer, bool to_frame) {
+    for(int plane = 0; plane < 3; plane++) {
+        int width = plane == 0 ? frame->width : (frame->width + 1) / 2;
+        int height = plane == 0 ? frame->height : (frame->height + 1) / 2;
+        for(int row = 0; row < height; row++) {
+            uint8_t *line = frame->data[plane] + row * frame->linesize[plane];
+            if(to_frame) {
+                memcpy(line, buffer, width);
+            }
+            else {
+                memcpy(buffer, line, width);
+            }
+            buffer += width;
+        }
+    }
+}
+
+static bool write_all(int fd, const void *data, size_t size) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    while(size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if(written <= 0) {
+            return false;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+frame_spool_writer::~frame_spool_writer() {
+    unmap_segment(-1);
+    if(index_fd >= 0) {
+        ::close(index_fd);
+    }
+    if(audio_fd >= 0) {
+        ::close(audio_fd);
+    }
+}
+
+int32_t frame_spool_writer::open(const std::string &directory, int width, int height, int time_base_num, int time_base_den,
+                                 int sample_rate, int channels, int bytes_per_sample) {
+    this->directory = directory;
+    mkdir(directory.c_str(), 0755);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FRAME_SPOOL_MAGIC, 4);
+    header.version = FRAME_SPOOL_VERSION;
+    header.width = width;
+    header.height = height;
+    header.time_base_num = time_base_num;
+    header.time_base_den = time_base_den;
+    header.sample_rate = sample_rate;
+    header.channels = channels;
+    header.bytes_per_sample = bytes_per_sample;
+    header.complete = 0;
+    frame_bytes = yuv420p_bytes(width, height);
+
+    if(write_header() < 0) {
+        return -1;
+    }
+
+    // 新的采集覆盖目录中已有的缓存
+    index_fd = ::open((directory + "/frames.idx").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    audio_fd = ::open((directory + "/audio.pcm").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(index_fd < 0 || audio_fd < 0) {
+        std::cerr << "Error: could not create frame spool in " << directory << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+int32_t frame_spool_writer::write_header() {
+    FILE *output = fopen((directory + "/spool.hdr").c_str(), "wb");
+    if(output == nullptr) {
+        std::cerr << "Error: could not write frame spool header in " << directory << std::endl;
+        return -1;
+    }
+    fwrite(&header, sizeof(header), 1, output);
+    bool failed = ferror(output);
+    fclose(output);
+    return failed ? -1 : 0;
+}
+
+int32_t frame_spool_writer::map_segment(int64_t index) {
+    unmap_segment(-1);
+
+    std::string file = segment_path(directory, index);
+    int fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        std::cerr << "Error: could not create spool segment " << file << std::endl;
+        return -1;
+    }
+
+    // 预先扩展为整段大小，写帧时不再改变文件长度
+    size_t size = frame_bytes * FRAME_SPOOL_SEGMENT_FRAMES;
+    if(ftruncate(fd, size) < 0) {
+        std::cerr << "Error: could not resize spool segment " << file << std::endl;
+        ::close(fd);
+        return -1;
+    }
+
+    void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(mapping == MAP_FAILED) {
+        std::cerr << "Error: mmap spool segment failed." << std::endl;
+        return -1;
+    }
+    segment = (uint8_t *)mapping;
+    segment_index = index;
+    return 0;
+}
+
+// used_frames不小于0时把分段截断到实际帧数
+void frame_spool_writer::unmap_segment(int64_t used_frames) {
+    if(segment == nullptr) {
+        return;
+    }
+    size_t size = frame_bytes * FRAME_SPOOL_SEGMENT_FRAMES;
+    msync(segment, size, MS_ASYNC);
+    munmap(segment, size);
+    segment = nullptr;
+
+    if(used_frames >= 0) {
+        truncate(segment_path(directory, segment_index).c_str(), frame_bytes * used_frames);
+    }
+}
+
+int32_t frame_spool_writer::append(const AVFrame *frame, int64_t pts, int64_t duration) {
+    if(index_fd < 0) {
+        std::cerr << "Error: frame spool is not open." << std::endl;
+        return -1;
+    }
+    if(frame->format != AV_PIX_FMT_YUV420P || frame->width != header.width || frame->height != header.height) {
+        std::cerr << "Error: frame does not match spool format." << std::endl;
+        return -1;
+    }
+
+    int64_t index = frame_count / FRAME_SPOOL_SEGMENT_FRAMES;
+    if(index != segment_index || segment == nullptr) {
+        if(map_segment(index) < 0) {
+            return -1;
+        }
+    }
+
+    uint8_t *slot = segment + frame_bytes * (frame_count % FRAME_SPOOL_SEGMENT_FRAMES);
+    copy_planes((AVFrame *)frame, slot, false);
+
+    FrameSpoolRecord record = {pts, duration};
+    if(!write_all(index_fd, &record, sizeof(record))) {
+        std::cerr << "Error: could not write spool index." << std::endl;
+        return -1;
+    }
+    frame_count++;
+    return 0;
+}
+
+int32_t frame_spool_writer::append_audio(const uint8_t *data, size_t size) {
+    if(audio_fd < 0 || !write_all(audio_fd, data, size)) {
+        std::cerr << "Error: could not write spool audio." << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+int32_t frame_spool_writer::finish() {
+    if(index_fd < 0) {
+        return 0;
+    }
+
+    int64_t used = frame_count - segment_index * FRAME_SPOOL_SEGMENT_FRAMES;
+    unmap_segment(segment_index >= 0 ? used : -1);
+    ::close(index_fd);
+    ::close(audio_fd);
+    index_fd = -1;
+    audio_fd = -1;
+
+    header.complete = 1;
+    return write_header();
+}
+
+int64_t frame_spool_writer::size() {
+    return frame_count;
+}
+
+frame_spool_reader::~frame_spool_reader() {
+    close();
+}
+
+int32_t frame_spool_reader::open(const std::string &directory) {
+    close();
+    this->directory = directory;
+
+    FILE *input = fopen((directory + "/spool.hdr").c_str(), "rb");
+    if(input == nullptr) {
+        std::cerr << "Error: could not open frame spool " << directory << std::endl;
+        return -1;
+    }
+    bool valid = fread(&header, sizeof(header), 1, input) == 1
+                 && memcmp(header.magic, FRAME_SPOOL_MAGIC, 4) == 0 && header.version == FRAME_SPOOL_VERSION;
+    fclose(input);
+    if(!valid) {
+        std::cerr << "Error: invalid frame spool " << directory << std::endl;
+        return -1;
+    }
+    frame_bytes = yuv420p_bytes(header.width, header.height);
+
+    // 只保留完整的索引记录
+    input = fopen((directory + "/frames.idx").c_str(), "rb");
+    if(input != nullptr) {
+        FrameSpoolRecord record;
+        while(fread(&record, sizeof(record), 1, input) == 1) {
+            records.push_back(record);
+        }
+        fclose(input);
+    }
+    if(!header.complete) {
+        std::cerr << "Warning: frame spool " << directory << " was interrupted, " << records.size() << " frames recovered." << std::endl;
+    }
+
+    int fd = ::open((directory + "/audio.pcm").c_str(), O_RDONLY);
+    if(fd >= 0) {
+        struct stat st;
+        if(fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if(mapping != MAP_FAILED) {
+                audio = (const uint8_t *)mapping;
+                audio_size = st.st_size;
+            }
+        }
+        ::close(fd);
+    }
+    return 0;
+}
+
+void frame_spool_reader::unmap_segment() {
+    if(segment) {
+        munmap((void *)segment, segment_size);
+    }
+    segment = nullptr;
+    segment_size = 0;
+    segment_index = -1;
+}
+
+void frame_spool_reader::close() {
+    unmap_segment();
+    if(audio) {
+        munmap((void *)audio, audio_size);
+    }
+    audio = nullptr;
+    audio_size = 0;
+    records.clear();
+}
+
+const FrameSpoolHeader &frame_spool_reader::get_header() {
+    return header;
+}
+
+int64_t frame_spool_reader::size() {
+    return records.size();
+}
+
+const FrameSpoolRecord &frame_spool_reader::record(int64_t index) {
+    return records[index];
+}
+
+int32_t frame_spool_reader::read(int64_t index, AVFrame *frame) {
+    if(index < 0 || index >= (int64_t)records.size()) {
+        return -1;
+    }
+
+    int64_t segment_wanted = index / FRAME_SPOOL_SEGMENT_FRAMES;
+    if(segment_wanted != segment_index) {
+        unmap_segment();
+        std::string file = segment_path(directory, segment_wanted);
+        int fd = ::open(file.c_str(), O_RDONLY);
+        if(fd < 0) {
+            std::cerr << "Error: could not open spool segment " << file << std::endl;
+            return -1;
+        }
+        struct stat st;
+        void *mapping = MAP_FAILED;
+        if(fstat(fd, &st) == 0 && st.st_size > 0) {
+            mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if(mapping == MAP_FAILED) {
+            std::cerr << "Error: mmap spool segment " << file << " failed." << std::endl;
+            return -1;
+        }
+        // 顺序读取，提示内核预读
+        madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+        segment = (const uint8_t *)mapping;
+        segment_size = st.st_size;
+        segment_index = segment_wanted;
+    }
+
+    size_t offset = frame_bytes * (index % FRAME_SPOOL_SEGMENT_FRAMES);
+    if(offset + frame_bytes > segment_size) {
+        std::cerr << "Error: spool segment is truncated at frame " << index << std::endl;
+        return -1;
+    }
+    copy_planes(frame, (uint8_t *)segment + offset, true);
+    return 0;
+}
+
+const uint8_t *frame_spool_reader::audio_data() {
+    return audio;
+}
+
+size_t frame_spool_reader::audio_bytes() {
+    return audio_size;
+}
+
+transcode_checkpoint::~transcode_checkpoint() {
+    close_data();
+}
+
+void transcode_checkpoint::close_data() {
+    if(video_file) {
+        fclose(video_file);
+        video_file = nullptr;
+    }
+    if(packet_file) {
+        fclose(packet_file);
+        packet_file = nullptr;
+    }
+}
+
+// keep为false时清空数据文件，从头转码
+int32_t transcode_checkpoint::open_data(bool keep) {
+    const char *mode = keep ? "r+b" : "w+b";
+    video_file = fopen((directory + "/transcode.h264").c_str(), mode);
+    packet_file = fopen((directory + "/transcode.pkt").c_str(), mode);
+    if(video_file == nullptr || packet_file == nullptr) {
+        std::cerr << "Error: could not open transcode checkpoint in " << directory << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+int32_t transcode_checkpoint::open(const std::string &directory, const std::string &settings, TranscodeCheckpoint &state,
+                                   std::vector<uint8_t> &video, std::vector<PacketTiming> &packets) {
+    this->directory = directory;
+    video.clear();
+    packets.clear();
+    memset(&state, 0, sizeof(state));
+    memcpy(state.magic, TRANSCODE_CHECKPOINT_MAGIC, 4);
+    state.version = TRANSCODE_CHECKPOINT_VERSION;
+    snprintf(state.settings, sizeof(state.settings), "%s", settings.c_str());
+
+    TranscodeCheckpoint saved;
+    bool valid = false;
+    FILE *input = fopen((directory + "/transcode.ckpt").c_str(), "rb");
+    if(input != nullptr) {
+        valid = fread(&saved, sizeof(saved), 1, input) == 1
+                && memcmp(saved.magic, TRANSCODE_CHECKPOINT_MAGIC, 4) == 0 && saved.version == TRANSCODE_CHECKPOINT_VERSION
+                && strncmp(saved.settings, state.settings, sizeof(state.settings)) == 0;
+        fclose(input);
+        if(!valid) {
+            std::cerr << "Warning: ignore transcode checkpoint in " << directory << " written with other settings." << std::endl;
+        }
+    }
+    if(!valid) {
+        return open_data(false);
+    }
+
+    video.resize(saved.video_bytes);
+    packets.resize(saved.packet_count);
+    if(open_data(true) < 0 || fread(video.data(), 1, video.size(), video_file) != video.size()
+       || fread(packets.data(), sizeof(PacketTiming), packets.size(), packet_file) != packets.size()) {
+        std::cerr << "Warning: transcode checkpoint in " << directory << " is incomplete, start over." << std::endl;
+        video.clear();
+        packets.clear();
+        close_data();
+        return open_data(false);
+    }
+
+    // 丢弃上次中断时检查点之后写入的数据
+    if(ftruncate(fileno(video_file), saved.video_bytes) < 0 || ftruncate(fileno(packet_file), saved.packet_count * sizeof(PacketTiming)) < 0) {
+        std::cerr << "Error: could not truncate transcode checkpoint in " << directory << std::endl;
+        return -1;
+    }
+    fseek(video_file, 0, SEEK_END);
+    fseek(packet_file, 0, SEEK_END);
+    state = saved;
+    return 0;
+}
+
+int32_t transcode_checkpoint::save(const TranscodeCheckpoint &state, const uint8_t *video, size_t video_size,
+                                   const PacketTiming *packets, size_t packet_count) {
+    // 数据落盘后再替换状态，状态中的长度总是指向完整的数据
+    fwrite(video, 1, video_size, video_file);
+    fwrite(packets, sizeof(PacketTiming), packet_count, packet_file);
+    bool failed = fflush(video_file) != 0 || fflush(packet_file) != 0
+                  || fsync(fileno(video_file)) != 0 || fsync(fileno(packet_file)) != 0;
+
+    std::string file = directory + "/transcode.ckpt";
+    std::string temp = file + ".tmp";
+    FILE *output = failed ? nullptr : fopen(temp.c_str(), "wb");
+    if(output != nullptr) {
+        fwrite(&state, sizeof(state), 1, output);
+        failed = fflush(output) != 0 || fsync(fileno(output)) != 0;
+        fclose(output);
+    }
+    if(output == nullptr || failed || rename(temp.c_str(), file.c_str()) != 0) {
+        std::cerr << "Error: could not write transcode checkpoint " << file << std::endl;
+        unlink(temp.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+void transcode_checkpoint::remove() {
+    close_data();
+    unlink((directory + "/transcode.ckpt").c_str());
+    unlink((directory + "/transcode.h264").c_str());
+    unlink((directory + "/transcode.pkt").c_str());
+}
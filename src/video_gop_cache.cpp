@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <algorithm>
+
+#include "video_gop_cache.h"
+
+static inline uint64_t hash_mix(uint64_t h, uint64_t v) {
+    h ^= v * 0x9E3779B97F4A7C15ULL;
+    h = (h << 31) | (h >> 33);
+    return h * 0xC2B2AE3D27D4EB4FULL;
+}
+
+uint64_t content_hash(const void *data, size_t size, uint64_t seed) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint64_t h = seed ^ (size * 0x165667B19E3779F9ULL);
+
+    // 4路并行累加8字节字，减少依赖链
+    uint64_t lanes[4] = {h, h + 1, h + 2, h + 3};
+    size_t i = 0;
+    for(; i + 32 <= size; i += 32) {
+        for(int l = 0; l < 4; l++) {
+            uint64_t v;
+            memcpy(&v, bytes + i + l * 8, 8);
+            lanes[l] = hash_mix(lanes[l], v);
+        }
+    }
+    for(; i + 8 <= size; i += 8) {
+        uint64_t v;
+        memcpy(&v, bytes + i, 8);
+        lanes[0] = hash_mix(lanes[0], v);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, bytes + i, size - i);
+    lanes[1] = hash_mix(lanes[1], tail);
+
+    h = hash_mix(hash_mix(lanes[0], lanes[1]), hash_mix(lanes[2], lanes[3]));
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    return h ^ (h >> 32);
+}
+
+gop_cache::gop_cache(const std::string &directory, uint64_t max_bytes) {
+    this->directory = directory;
+    this->max_bytes = max_bytes;
+    mkdir(directory.c_str(), 0755);
+    total_bytes = scan();
+}
+
+std::string gop_cache::path(const GopCacheKey &key) {
+    char name[40];
+    snprintf(name, sizeof(name), "%016llx%016llx.gop", (unsigned long long)key.high, (unsigned long long)key.low);
+    return directory + "/" + name;
+}
+
+uint64_t gop_cache::scan() {
+    uint64_t bytes = 0;
+    DIR *dir = opendir(directory.c_str());
+    if(dir == nullptr) {
+        return 0;
+    }
+
+    struct dirent *entry;
+    while((entry = readdir(dir)) != nullptr) {
+        if(fnmatch("*.gop", entry->d_name, 0) != 0) {
+            continue;
+        }
+        struct stat st;
+        if(stat((directory + "/" + entry->d_name).c_str(), &st) == 0) {
+            bytes += st.st_size;
+        }
+    }
+    closedir(dir);
+    return bytes;
+}
+
+// 按修改时间从旧到新删除，命中时会更新修改时间
+void gop_cache::evict() {
+    std::vector<std::pair<time_t, std::pair<std::string, uint64_t> > > files;
+    DIR *dir = opendir(directory.c_str());
+    if(dir == nullptr) {
+        return;
+    }
+
+    struct dirent *entry;
+    while((entry = readdir(dir)) != nullptr) {
+        if(fnmatch("*.gop", entry->d_name, 0) != 0) {
+            continue;
+        }
+        std::string file = directory + "/" + entry->d_name;
+        struct stat st;
+        if(stat(file.c_str(), &st) == 0) {
+            files.push_back(std::make_pair(st.st_mtime, std::make_pair(file, (uint64_t)st.st_size)));
+        }
+    }
+    closedir(dir);
+
+    std::sort(files.begin(), files.end());
+    total_bytes = 0;
+    for(size_t i = 0; i < files.size(); i++) {
+        total_bytes += files[i].second.second;
+    }
+    for(size_t i = 0; i < files.size() && total_bytes > max_bytes; i++) {
+        if(unlink(files[i].second.first.c_str()) == 0) {
+            total_bytes -= files[i].second.second;
+        }
+    }
+}
+
+bool gop_cache::lookup(const GopCacheKey &key, const GopCacheShape &shape, std::vector<uint8_t> &data, std::vector<PacketTiming> &packets) {
+    std::string file = path(key);
+    FILE *input = fopen(file.c_str(), "rb");
+    if(input == nullptr) {
+        return false;
+    }
+
+    GopCacheHeader header;
+    bool valid = fread(&header, sizeof(header), 1, input) == 1
+                 && memcmp(header.magic, GOP_CACHE_MAGIC, 4) == 0 && header.version == GOP_CACHE_VERSION;
+    // 帧数、尺寸或包数不符说明是键碰撞，按未命中处理，不删除文件
+    if(valid && (header.shape.frame_count != shape.frame_count || header.shape.width != shape.width
+                 || header.shape.height != shape.height || header.packet_count != shape.frame_count)) {
+        std::cerr << "Warning: gop cache key collision on " << file << std::endl;
+        fclose(input);
+        return false;
+    }
+    if(valid) {
+        packets.resize(header.packet_count);
+        data.resize(header.data_size);
+        valid = fread(packets.data(), sizeof(PacketTiming), packets.size(), input) == packets.size()
+                && fread(data.data(), 1, data.size(), input) == data.size();
+    }
+    fclose(input);
+
+    if(!valid) {
+        std::cerr << "Warning: drop invalid gop cache file " << file << std::endl;
+        unlink(file.c_str());
+        return false;
+    }
+
+    // 更新修改时间，用于LRU淘汰
+    utime(file.c_str(), nullptr);
+    return true;
+}
+
+int32_t gop_cache::store(const GopCacheKey &key, const GopCacheShape &shape, const uint8_t *data, size_t size,
+                         const std::vector<PacketTiming> &packets) {
+    std::string file = path(key);
+    std::string temp = file + ".tmp";
+    FILE *output = fopen(temp.c_str(), "wb");
+    if(output == nullptr) {
+        std::cerr << "Error: could not open gop cache file " << temp << std::endl;
+        return -1;
+    }
+
+    GopCacheHeader header;
+    memcpy(header.magic, GOP_CACHE_MAGIC, 4);
+    header.version = GOP_CACHE_VERSION;
+    header.packet_count = packets.size();
+    header.data_size = size;
+    header.shape = shape;
+
+    fwrite(&header, sizeof(header), 1, output);
+    fwrite(packets.data(), sizeof(PacketTiming), packets.size(), output);
+    fwrite(data, 1, size, output);
+    bool failed = ferror(output);
+    fclose(output);
+
+    // 先写临时文件再改名，中断时不会留下不完整的缓存
+    if(failed || rename(temp.c_str(), file.c_str()) != 0) {
+        std::cerr << "Error: could not write gop cache file " << file << std::endl;
+        unlink(temp.c_str());
+        return -1;
+    }
+
+    total_bytes += sizeof(header) + packets.size() * sizeof(PacketTiming) + size;
+    if(max_bytes > 0 && total_bytes > max_bytes) {
+        evict();
+    }
+    return 0;
+}
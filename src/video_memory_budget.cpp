@@ -0,0 +1,336 @@
+#include <mutex>
+#include <list>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <condition_variable>
+
+extern "C" {
+    #include <libavutil/avutil.h>
+}
+
+#include "video_memory_budget.h"
+
+static std::mutex budget_mutex;
+static std::condition_variable budget_cond;
+
+// 异步等待预算的请求，所有预算共用一个队列，同一预算内按排队顺序放行
+typedef struct {
+    memory_budget *budget;
+    size_t bytes;
+    bool timed;
+    std::chrono::steady_clock::time_point deadline;
+    std::function<void(int32_t)> granted;
+}BudgetWaiter;
+
+static std::list<BudgetWaiter> async_waiters;
+
+// 超时策略的异步等待由一个线程统一到期，首次需要时启动
+typedef struct BudgetTimer {
+    std::thread thread;
+    std::condition_variable cond;
+    bool stopping = false;
+
+    ~BudgetTimer() {
+        {
+            std::lock_guard<std::mutex> lock(budget_mutex);
+            stopping = true;
+        }
+        cond.notify_all();
+        if(thread.joinable()) {
+            thread.join();
+        }
+    }
+}BudgetTimer;
+
+static BudgetTimer budget_timer;
+
+memory_budget::memory_budget(memory_budget *parent, bool retains) {
+    this->parent = parent;
+    this->retains = retains;
+    limit = 0;
+    usage = 0;
+    retained = 0;
+    peak = 0;
+    policy = MEMORY_POLICY_NONBLOCK;
+    timeout_ms = 0;
+}
+
+memory_budget *memory_budget::process() {
+    static memory_budget process_budget;
+    return &process_budget;
+}
+
+void memory_budget::set_limit(size_t limit) {
+    std::vector<std::pair<std::function<void(int32_t)>, int32_t> > ready;
+    {
+        std::lock_guard<std::mutex> lock(budget_mutex);
+        this->limit = limit;
+        grant_waiters_locked(ready);
+    }
+    budget_cond.notify_all();
+    run_granted(ready);
+}
+
+void memory_budget::set_policy(memory_policy policy, int64_t timeout_ms) {
+    std::lock_guard<std::mutex> lock(budget_mutex);
+    this->policy = policy;
+    this->timeout_ms = timeout_ms;
+}
+
+// 需持有budget_mutex
+// 用量为0时总是放行，避免单次请求超过预算时永久阻塞
+bool memory_budget::has_room(size_t bytes) {
+    if(limit != 0 && usage != 0 && usage + bytes > limit) {
+        return false;
+    }
+    return parent ? parent->has_room(bytes) : true;
+}
+
+// 需持有budget_mutex
+// 常驻用量加上本次请求已超过限额时，等待其它用量释放也无法放行
+bool memory_budget::may_fit(size_t bytes) {
+    if(limit != 0 && retained != 0 && retained + bytes > limit) {
+        return false;
+    }
+    return parent ? parent->may_fit(bytes) : true;
+}
+
+int32_t memory_budget::wait_for_room(size_t bytes) {
+    std::unique_lock<std::mutex> lock(budget_mutex);
+    return wait_locked(lock, bytes);
+}
+
+// 需持有budget_mutex
+int32_t memory_budget::wait_locked(std::unique_lock<std::mutex> &lock, size_t bytes) {
+    if(has_room(bytes)) {
+        return 0;
+    }
+    if(!may_fit(bytes)) {
+        return AVERROR(ENOMEM);
+    }
+
+    switch(policy) {
+        case MEMORY_POLICY_BLOCK:
+            budget_cond.wait(lock, [&]{ return has_room(bytes) || !may_fit(bytes); });
+            return has_room(bytes) ? 0 : AVERROR(ENOMEM);
+        case MEMORY_POLICY_TIMEOUT:
+            if(budget_cond.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&]{ return has_room(bytes) || !may_fit(bytes); })) {
+                return has_room(bytes) ? 0 : AVERROR(ENOMEM);
+            }
+            return AVERROR(ETIMEDOUT);
+        default:
+            return AVERROR(EAGAIN);
+    }
+}
+
+bool memory_budget::try_charge(size_t bytes) {
+    std::lock_guard<std::mutex> lock(budget_mutex);
+    if(!has_room(bytes)) {
+        return false;
+    }
+    charge_locked(bytes);
+    return true;
+}
+
+int32_t memory_budget::wait_and_charge(size_t bytes) {
+    std::unique_lock<std::mutex> lock(budget_mutex);
+    int32_t ret = wait_locked(lock, bytes);
+    if(ret == 0) {
+        charge_locked(bytes);
+    }
+    return ret;
+}
+
+int32_t memory_budget::charge_async(size_t bytes, std::function<void(int32_t)> granted) {
+    std::lock_guard<std::mutex> lock(budget_mutex);
+    // 已有排队的请求时不插队
+    bool queued = false;
+    for(std::list<BudgetWaiter>::iterator it = async_waiters.begin(); it != async_waiters.end(); ++it) {
+        if(it->budget == this) {
+            queued = true;
+            break;
+        }
+    }
+    if(!queued && has_room(bytes)) {
+        charge_locked(bytes);
+        return 0;
+    }
+    if(!may_fit(bytes)) {
+        return AVERROR(ENOMEM);
+    }
+    if(policy == MEMORY_POLICY_NONBLOCK) {
+        return AVERROR(EAGAIN);
+    }
+
+    BudgetWaiter waiter;
+    waiter.budget = this;
+    waiter.bytes = bytes;
+    waiter.timed = policy == MEMORY_POLICY_TIMEOUT;
+    waiter.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    waiter.granted = granted;
+    async_waiters.push_back(waiter);
+
+    if(waiter.timed) {
+        if(!budget_timer.thread.joinable()) {
+            budget_timer.thread = std::thread(timer_loop);
+        }
+        budget_timer.cond.notify_all();
+    }
+    return 1;
+}
+
+void memory_budget::cancel_waits() {
+    std::vector<std::pair<std::function<void(int32_t)>, int32_t> > ready;
+    {
+        std::lock_guard<std::mutex> lock(budget_mutex);
+        for(std::list<BudgetWaiter>::iterator it = async_waiters.begin(); it != async_waiters.end();) {
+            if(it->budget == this) {
+                ready.push_back(std::make_pair(it->granted, AVERROR(ECANCELED)));
+                it = async_waiters.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+    run_granted(ready);
+}
+
+// 需持有budget_mutex
+void memory_budget::grant_waiters_locked(std::vector<std::pair<std::function<void(int32_t)>, int32_t> > &ready) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::vector<memory_budget *> blocked;
+    for(std::list<BudgetWaiter>::iterator it = async_waiters.begin(); it != async_waiters.end();) {
+        // 同一预算前面的请求仍在等待时，后面的请求不能先放行
+        if(std::find(blocked.begin(), blocked.end(), it->budget) != blocked.end()) {
+            ++it;
+            continue;
+        }
+
+        int32_t result = 1;
+        if(it->budget->has_room(it->bytes)) {
+            it->budget->charge_locked(it->bytes);
+            result = 0;
+        }
+        else if(!it->budget->may_fit(it->bytes)) {
+            result = AVERROR(ENOMEM);
+        }
+        else if(it->timed && now >= it->deadline) {
+            result = AVERROR(ETIMEDOUT);
+        }
+
+        if(result > 0) {
+            blocked.push_back(it->budget);
+            ++it;
+            continue;
+        }
+        ready.push_back(std::make_pair(it->granted, result));
+        it = async_waiters.erase(it);
+    }
+}
+
+void memory_budget::run_granted(std::vector<std::pair<std::function<void(int32_t)>, int32_t> > &ready) {
+    for(size_t i = 0; i < ready.size(); i++) {
+        ready[i].first(ready[i].second);
+    }
+}
+
+void memory_budget::timer_loop() {
+    std::unique_lock<std::mutex> lock(budget_mutex);
+    while(!budget_timer.stopping) {
+        bool timed = false;
+        std::chrono::steady_clock::time_point deadline;
+        for(std::list<BudgetWaiter>::iterator it = async_waiters.begin(); it != async_waiters.end(); ++it) {
+            if(it->timed && (!timed || it->deadline < deadline)) {
+                deadline = it->deadline;
+                timed = true;
+            }
+        }
+        if(!timed) {
+            budget_timer.cond.wait(lock);
+            continue;
+        }
+        if(budget_timer.cond.wait_until(lock, deadline) != std::cv_status::timeout) {
+            continue;
+        }
+
+        std::vector<std::pair<std::function<void(int32_t)>, int32_t> > ready;
+        grant_waiters_locked(ready);
+        lock.unlock();
+        run_granted(ready);
+        lock.lock();
+    }
+}
+
+void memory_budget::charge(size_t bytes) {
+    std::vector<std::pair<std::function<void(int32_t)>, int32_t> > ready;
+    {
+        std::lock_guard<std::mutex> lock(budget_mutex);
+        charge_locked(bytes);
+        // 常驻用量增长后，排队的请求可能已无法满足
+        if(retains) {
+            grant_waiters_locked(ready);
+        }
+    }
+    run_granted(ready);
+}
+
+// 需持有budget_mutex
+void memory_budget::charge_locked(size_t bytes) {
+    for(memory_budget *budget = this; budget; budget = budget->parent) {
+        budget->usage += bytes;
+        if(retains) {
+            budget->retained += bytes;
+        }
+        if(budget->usage > budget->peak) {
+            budget->peak = budget->usage;
+        }
+    }
+    // 常驻用量增长可能使等待者再也无法放行，唤醒它们重新判断
+    if(retains) {
+        budget_cond.notify_all();
+    }
+}
+
+void memory_budget::release(size_t bytes) {
+    std::vector<std::pair<std::function<void(int32_t)>, int32_t> > ready;
+    {
+        std::lock_guard<std::mutex> lock(budget_mutex);
+        for(memory_budget *budget = this; budget; budget = budget->parent) {
+            budget->usage -= bytes < budget->usage ? bytes : budget->usage;
+            if(retains) {
+                budget->retained -= bytes < budget->retained ? bytes : budget->retained;
+            }
+        }
+        grant_waiters_locked(ready);
+    }
+    budget_cond.notify_all();
+    // 放行的请求在当前线程回调，回调内只应投递任务
+    run_granted(ready);
+}
+
+bool memory_budget::over_limit() {
+    std::lock_guard<std::mutex> lock(budget_mutex);
+    return limit != 0 && usage > limit;
+}
+
+size_t memory_budget::get_usage() {
+    std::lock_guard<std::mutex> lock(budget_mutex);
+    return usage;
+}
+
+size_t memory_budget::get_peak() {
+    std::lock_guard<std::mutex> lock(budget_mutex);
+    return peak;
+}
+
+size_t memory_budget::get_limit() {
+    std::lock_guard<std::mutex> lock(budget_mutex);
+    return limit;
+}
+
+memory_policy memory_budget::get_policy() {
+    std::lock_guard<std::mutex> lock(budget_mutex);
+    return policy;
+}
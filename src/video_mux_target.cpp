@@ -0,0 +1,169 @@
+#include <iostream>
+
+#include "video_mux_target.h"
+#include "video_trace.h"
+
+// 每个输出最多排队的包数，慢的封装器会让读包等待
+#define MUX_TARGET_QUEUE_SIZE 256
+
+mux_target::mux_target(const std::string &format, const std::string &file) {
+    this->format = format;
+    this->file = file;
+}
+
+mux_target::~mux_target() {
+    finish();
+
+    for(size_t i = 0; i < queue.size(); i++) {
+        av_packet_free(&queue[i].first);
+    }
+    if(fmt_ctx) {
+        if(own_pb) {
+            avio_closep(&fmt_ctx->pb);
+        }
+        // 调用方提供的pb由调用方释放
+        avformat_free_context(fmt_ctx);
+    }
+}
+
+int32_t mux_target::open(AVIOContext *pb, const AVCodecParameters *video_par, AVRational video_time_base,
+                         const AVCodecParameters *audio_par, AVRational audio_time_base) {
+    avformat_alloc_output_context2(&fmt_ctx, nullptr, format.c_str(), file.empty() ? nullptr : file.c_str());
+    if(!fmt_ctx) {
+        std::cerr << "Error: alloc output format context for " << format << " failed!" << std::endl;
+        return -1;
+    }
+
+    if(file.empty()) {
+        fmt_ctx->pb = pb;
+    }
+    else {
+        if(avio_open(&fmt_ctx->pb, file.c_str(), AVIO_FLAG_WRITE) < 0) {
+            std::cerr << "Error: could not open output file " << file << std::endl;
+            return -1;
+        }
+        own_pb = true;
+    }
+
+    const AVCodecParameters *pars[2] = {video_par, audio_par};
+    AVRational time_bases[2] = {video_time_base, audio_time_base};
+    for(int i = 0; i < 2; i++) {
+        AVStream *stream = avformat_new_stream(fmt_ctx, nullptr);
+        if(!stream) {
+            std::cerr << "Error: add stream to " << format << " output failed!" << std::endl;
+            return -1;
+        }
+        if(avcodec_parameters_copy(stream->codecpar, pars[i]) < 0) {
+            std::cerr << "Error: copy codec parameters failed!" << std::endl;
+            return -1;
+        }
+        stream->id = i;
+        stream->time_base = time_bases[i];
+    }
+
+    int32_t ret = avformat_write_header(fmt_ctx, nullptr);
+    if(ret < 0) {
+        std::cerr << "Error: write " << format << " header failed!" << std::endl;
+        return ret;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = false;
+    }
+    worker = std::thread(&mux_target::worker_loop, this);
+    return 0;
+}
+
+void mux_target::push(const AVPacket *pkt, AVRational time_base) {
+    AVPacket *ref = av_packet_alloc();
+    if(!ref || av_packet_ref(ref, pkt) < 0) {
+        av_packet_free(&ref);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this]{ return queue.size() < MUX_TARGET_QUEUE_SIZE || stopped; });
+    // 写包线程已退出时没有人消费队列，直接丢弃
+    if(stopped) {
+        lock.unlock();
+        av_packet_free(&ref);
+        return;
+    }
+    queue.push_back(std::make_pair(ref, time_base));
+    cond.notify_all();
+}
+
+void mux_target::worker_loop() {
+    video_trace::set_thread_name("mux_target");
+    while(1) {
+        std::pair<AVPacket *, AVRational> item;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this]{ return ending || !queue.empty(); });
+            if(queue.empty()) {
+                stopped = true;
+                cond.notify_all();
+                return;
+            }
+            item = queue.front();
+            queue.pop_front();
+            cond.notify_all();
+        }
+
+        AVPacket *pkt = item.first;
+        if(result >= 0) {
+            AVStream *stream = fmt_ctx->streams[pkt->stream_index];
+            pkt->pts = av_rescale_q_rnd(pkt->pts, item.second, stream->time_base, (AVRounding)(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+            pkt->dts = av_rescale_q_rnd(pkt->dts, item.second, stream->time_base, (AVRounding)(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+            pkt->duration = av_rescale_q(pkt->duration, item.second, stream->time_base);
+
+            // 包已按时间交错，直接写入以便记录每个包在文件中的偏移
+            int64_t pts = av_rescale_q(pkt->pts, stream->time_base, (AVRational){1, SEEK_INDEX_TIME_SCALE});
+            int64_t dts = av_rescale_q(pkt->dts, stream->time_base, (AVRational){1, SEEK_INDEX_TIME_SCALE});
+            int32_t stream_index = pkt->stream_index;
+            bool keyframe = pkt->flags & AV_PKT_FLAG_KEY;
+            int64_t offset = avio_tell(fmt_ctx->pb);
+            trace_span span("mux_write", pts);
+            result = av_write_frame(fmt_ctx, pkt);
+            if(result < 0) {
+                std::cerr << "Error: failed to mux packet to " << format << "!" << std::endl;
+            }
+            else {
+                index.add(stream_index, pts, dts, avio_tell(fmt_ctx->pb) - offset, offset, keyframe);
+            }
+        }
+        av_packet_free(&pkt);
+    }
+}
+
+int32_t mux_target::finish() {
+    if(!worker.joinable()) {
+        return result;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ending = true;
+    }
+    cond.notify_all();
+    worker.join();
+
+    trace_span span("mux_trailer");
+    int32_t ret = av_write_trailer(fmt_ctx);
+    if(result >= 0) {
+        result = ret;
+    }
+    if(own_pb) {
+        avio_flush(fmt_ctx->pb);
+    }
+    return result;
+}
+
+const std::string &mux_target::get_file() {
+    return file;
+}
+
+int32_t mux_target::write_index(const char *index_file) {
+    return index.write(index_file);
+}
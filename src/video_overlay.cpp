@@ -0,0 +1,258 @@
+#include <string.h>
+#include <iostream>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <opencv2/opencv.hpp>
+#include "video_overlay.h"
+
+// x / 255，四舍五入，对0~65025精确
+static inline uint8_t div255(uint32_t x) {
+    return (uint8_t)((x + 128 + ((x + 128) >> 8)) >> 8);
+}
+
+// dst = src + dst * (255 - alpha) / 255，src已预乘alpha
+static void blend_row(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, int n) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i full = _mm_set1_epi16(255);
+    const __m128i half = _mm_set1_epi16(128);
+    for(; i + 16 <= n; i += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i a = _mm_loadu_si128((const __m128i *)(alpha + i));
+
+        __m128i d_lo = _mm_unpacklo_epi8(d, zero);
+        __m128i d_hi = _mm_unpackhi_epi8(d, zero);
+        __m128i inv_lo = _mm_sub_epi16(full, _mm_unpacklo_epi8(a, zero));
+        __m128i inv_hi = _mm_sub_epi16(full, _mm_unpackhi_epi8(a, zero));
+
+        __m128i t_lo = _mm_add_epi16(_mm_mullo_epi16(d_lo, inv_lo), half);
+        __m128i t_hi = _mm_add_epi16(_mm_mullo_epi16(d_hi, inv_hi), half);
+        t_lo = _mm_srli_epi16(_mm_add_epi16(t_lo, _mm_srli_epi16(t_lo, 8)), 8);
+        t_hi = _mm_srli_epi16(_mm_add_epi16(t_hi, _mm_srli_epi16(t_hi, 8)), 8);
+
+        __m128i r = _mm_adds_epu8(_mm_packus_epi16(t_lo, t_hi), s);
+        _mm_storeu_si128((__m128i *)(dst + i), r);
+    }
+#endif
+    for(; i < n; i++) {
+        uint32_t r = src[i] + div255(dst[i] * (255 - alpha[i]));
+        dst[i] = r > 255 ? 255 : r;
+    }
+}
+
+std::shared_ptr<YuvaSprite> video_overlay::convert_sprite(const cv::Mat &image) {
+    if(image.empty() || (image.channels() != 3 && image.channels() != 4)) {
+        return std::shared_ptr<YuvaSprite>();
+    }
+
+    std::shared_ptr<YuvaSprite> sprite = std::make_shared<YuvaSprite>();
+    sprite->width = (image.cols + 1) & ~1;
+    sprite->height = (image.rows + 1) & ~1;
+
+    // 补齐为偶数尺寸，补齐部分完全透明
+    cv::Mat bgra(sprite->height, sprite->width, CV_8UC4, cv::Scalar(0, 0, 0, 0));
+    cv::Mat roi = bgra(cv::Rect(0, 0, image.cols, image.rows));
+    if(image.channels() == 4) {
+        image.copyTo(roi);
+    }
+    else {
+        cv::cvtColor(image, roi, cv::COLOR_BGR2BGRA);
+    }
+
+    cv::Mat yuv;
+    cv::cvtColor(bgra, yuv, cv::COLOR_BGRA2YUV_I420);
+
+    int w = sprite->width, h = sprite->height;
+    int cw = w / 2, ch = h / 2;
+    const uint8_t *y_plane = yuv.data;
+    const uint8_t *u_plane = y_plane + w * h;
+    const uint8_t *v_plane = u_plane + cw * ch;
+
+    sprite->y.resize(w * h);
+    sprite->alpha.resize(w * h);
+    for(int row = 0; row < h; row++) {
+        const uint8_t *src = bgra.ptr<uint8_t>(row);
+        for(int col = 0; col < w; col++) {
+            uint8_t a = src[col * 4 + 3];
+            sprite->alpha[row * w + col] = a;
+            sprite->y[row * w + col] = div255(y_plane[row * w + col] * a);
+        }
+    }
+
+    sprite->u.resize(cw * ch);
+    sprite->v.resize(cw * ch);
+    sprite->alpha_uv.resize(cw * ch);
+    for(int row = 0; row < ch; row++) {
+        for(int col = 0; col < cw; col++) {
+            const uint8_t *a = &sprite->alpha[row * 2 * w + col * 2];
+            uint8_t a_uv = (a[0] + a[1] + a[w] + a[w + 1] + 2) >> 2;
+            sprite->alpha_uv[row * cw + col] = a_uv;
+            sprite->u[row * cw + col] = div255(u_plane[row * cw + col] * a_uv);
+            sprite->v[row * cw + col] = div255(v_plane[row * cw + col] * a_uv);
+        }
+    }
+
+    return sprite;
+}
+
+// 直接拷贝YUVA420P平面，奇数尺寸补齐为透明，未预乘时在这里预乘
+std::shared_ptr<YuvaSprite> video_overlay::convert_yuva(const AVFrame *frame, bool premultiplied) {
+    if(!frame || frame->format != AV_PIX_FMT_YUVA420P || frame->width <= 0 || frame->height <= 0) {
+        return std::shared_ptr<YuvaSprite>();
+    }
+
+    std::shared_ptr<YuvaSprite> sprite = std::make_shared<YuvaSprite>();
+    int w = sprite->width = (frame->width + 1) & ~1;
+    int h = sprite->height = (frame->height + 1) & ~1;
+    int cw = w / 2, ch = h / 2;
+
+    sprite->y.assign(w * h, 0);
+    sprite->alpha.assign(w * h, 0);
+    for(int row = 0; row < frame->height; row++) {
+        const uint8_t *src_y = frame->data[0] + row * frame->linesize[0];
+        const uint8_t *src_a = frame->data[3] + row * frame->linesize[3];
+        for(int col = 0; col < frame->width; col++) {
+            uint8_t a = src_a[col];
+            sprite->alpha[row * w + col] = a;
+            sprite->y[row * w + col] = premultiplied ? std::min(src_y[col], a) : div255(src_y[col] * a);
+        }
+    }
+
+    sprite->u.resize(cw * ch);
+    sprite->v.resize(cw * ch);
+    sprite->alpha_uv.resize(cw * ch);
+    for(int row = 0; row < ch; row++) {
+        const uint8_t *src_u = frame->data[1] + row * frame->linesize[1];
+        const uint8_t *src_v = frame->data[2] + row * frame->linesize[2];
+        for(int col = 0; col < cw; col++) {
+            const uint8_t *a = &sprite->alpha[row * 2 * w + col * 2];
+            uint8_t a_uv = (a[0] + a[1] + a[w] + a[w + 1] + 2) >> 2;
+            sprite->alpha_uv[row * cw + col] = a_uv;
+            if(premultiplied) {
+                // 预乘后的值不超过alpha，截断异常输入避免混合溢出
+                sprite->u[row * cw + col] = std::min(src_u[col], a_uv);
+                sprite->v[row * cw + col] = std::min(src_v[col], a_uv);
+            }
+            else {
+                sprite->u[row * cw + col] = div255(src_u[col] * a_uv);
+                sprite->v[row * cw + col] = div255(src_v[col] * a_uv);
+            }
+        }
+    }
+
+    return sprite;
+}
+
+void video_overlay::put(int id, std::shared_ptr<YuvaSprite> sprite, int x, int y) {
+    std::lock_guard<std::mutex> lock(mutex);
+    OverlayItem &item = items[id];
+    item.sprite = sprite;
+    item.x = x;
+    item.y = y;
+    item.visible = true;
+}
+
+int32_t video_overlay::set(int id, const cv::Mat &image, int x, int y) {
+    std::shared_ptr<YuvaSprite> sprite = convert_sprite(image);
+    if(!sprite) {
+        std::cerr << "Error: overlay image must be BGR or BGRA." << std::endl;
+        return -1;
+    }
+
+    put(id, sprite, x, y);
+    return 0;
+}
+
+int32_t video_overlay::set_yuva(int id, const AVFrame *frame, int x, int y, bool premultiplied) {
+    std::shared_ptr<YuvaSprite> sprite = convert_yuva(frame, premultiplied);
+    if(!sprite) {
+        std::cerr << "Error: overlay frame must be YUVA420P." << std::endl;
+        return -1;
+    }
+
+    put(id, sprite, x, y);
+    return 0;
+}
+
+int32_t video_overlay::move(int id, int x, int y) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<int, OverlayItem>::iterator it = items.find(id);
+    if(it == items.end()) {
+        std::cerr << "Error: overlay " << id << " not found." << std::endl;
+        return -1;
+    }
+    it->second.x = x;
+    it->second.y = y;
+    return 0;
+}
+
+int32_t video_overlay::show(int id, bool visible) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<int, OverlayItem>::iterator it = items.find(id);
+    if(it == items.end()) {
+        std::cerr << "Error: overlay " << id << " not found." << std::endl;
+        return -1;
+    }
+    it->second.visible = visible;
+    return 0;
+}
+
+void video_overlay::remove(int id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    items.erase(id);
+}
+
+void video_overlay::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    items.clear();
+}
+
+bool video_overlay::empty() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return items.empty();
+}
+
+void video_overlay::blend(AVFrame *frame) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for(std::map<int, OverlayItem>::iterator it = items.begin(); it != items.end(); ++it) {
+        const OverlayItem &item = it->second;
+        if(!item.visible) {
+            continue;
+        }
+        const YuvaSprite *sprite = item.sprite.get();
+
+        // 位置对齐到偶数，保证色度与亮度一一对应
+        int x = item.x & ~1, y = item.y & ~1;
+        int x0 = std::max(x, 0), y0 = std::max(y, 0);
+        int x1 = std::min(x + sprite->width, frame->width);
+        int y1 = std::min(y + sprite->height, frame->height);
+        if(x0 >= x1 || y0 >= y1) {
+            continue;
+        }
+
+        // 只处理被覆盖的区域
+        for(int row = y0; row < y1; row++) {
+            int offset = (row - y) * sprite->width + (x0 - x);
+            blend_row(frame->data[0] + row * frame->linesize[0] + x0,
+                      &sprite->y[offset], &sprite->alpha[offset], x1 - x0);
+        }
+
+        int sprite_cw = sprite->width / 2;
+        int cx0 = x0 / 2, cy0 = y0 / 2;
+        int cx1 = std::min((x1 + 1) / 2, (frame->width + 1) / 2);
+        int cy1 = std::min((y1 + 1) / 2, (frame->height + 1) / 2);
+        for(int row = cy0; row < cy1; row++) {
+            int offset = (row - y / 2) * sprite_cw + (cx0 - x / 2);
+            blend_row(frame->data[1] + row * frame->linesize[1] + cx0,
+                      &sprite->u[offset], &sprite->alpha_uv[offset], cx1 - cx0);
+            blend_row(frame->data[2] + row * frame->linesize[2] + cx0,
+                      &sprite->v[offset], &sprite->alpha_uv[offset], cx1 - cx0);
+        }
+    }
+}
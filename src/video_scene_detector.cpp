@@ -0,0 +1,70 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "video_scene_detector.h"
+
+#define SCENE_BLOCK 8
+#define SCENE_BINS 32
+
+scene_detector::scene_detector(double threshold) {
+    this->threshold = threshold;
+}
+
+void scene_detector::reset() {
+    has_prev = false;
+}
+
+void scene_detector::downsample(const uint8_t *luma, int linesize, int width, int height) {
+    grid_width = width / SCENE_BLOCK;
+    grid_height = height / SCENE_BLOCK;
+    grid.resize(grid_width * grid_height);
+    row_sums.resize(grid_width * SCENE_BLOCK);
+
+    // 先按列累加8行，再每8列求块均值
+    for(int gy = 0; gy < grid_height; gy++) {
+        memset(row_sums.data(), 0, row_sums.size() * sizeof(uint32_t));
+        for(int r = 0; r < SCENE_BLOCK; r++) {
+            const uint8_t *src = luma + (gy * SCENE_BLOCK + r) * linesize;
+            uint32_t *sums = row_sums.data();
+            for(int x = 0; x < grid_width * SCENE_BLOCK; x++) {
+                sums[x] += src[x];
+            }
+        }
+        for(int gx = 0; gx < grid_width; gx++) {
+            uint32_t sum = 0;
+            for(int c = 0; c < SCENE_BLOCK; c++) {
+                sum += row_sums[gx * SCENE_BLOCK + c];
+            }
+            grid[gy * grid_width + gx] = sum / (SCENE_BLOCK * SCENE_BLOCK);
+        }
+    }
+}
+
+bool scene_detector::is_cut(const uint8_t *luma, int linesize, int width, int height) {
+    downsample(luma, linesize, width, height);
+    if(!has_prev || prev_grid.size() != grid.size() || grid.empty()) {
+        prev_grid.swap(grid);
+        has_prev = true;
+        return false;
+    }
+
+    // 直方图差异对运动不敏感，SAD补充检测亮度分布相近但内容不同的切换
+    int hist[SCENE_BINS] = {0}, prev_hist[SCENE_BINS] = {0};
+    uint64_t sad = 0;
+    for(size_t i = 0; i < grid.size(); i++) {
+        hist[grid[i] * SCENE_BINS / 256]++;
+        prev_hist[prev_grid[i] * SCENE_BINS / 256]++;
+        sad += abs((int)grid[i] - (int)prev_grid[i]);
+    }
+
+    uint64_t hist_diff = 0;
+    for(int i = 0; i < SCENE_BINS; i++) {
+        hist_diff += abs(hist[i] - prev_hist[i]);
+    }
+
+    double hist_score = (double)hist_diff / (2.0 * grid.size());
+    double sad_score = (double)sad / (255.0 * grid.size());
+    prev_grid.swap(grid);
+
+    return hist_score > threshold || sad_score > threshold / 2;
+}
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+
+#include "video_seek_index.h"
+
+// packets之后补齐到8字节，保证keyframes对齐
+static size_t packets_bytes(uint64_t packet_count) {
+    return (packet_count * sizeof(SeekIndexPacket) + 7) & ~(size_t)7;
+}
+
+seek_index_writer::seek_index_writer(uint32_t time_scale, int key_stream) {
+    this->time_scale = time_scale;
+    this->key_stream = key_stream;
+}
+
+void seek_index_writer::add(int stream, int64_t pts, int64_t dts, uint32_t size, int64_t offset, bool keyframe) {
+    if(packets.size() % SEEK_INDEX_BLOCK_SIZE == 0) {
+        SeekIndexBlock block = {dts, offset};
+        blocks.push_back(block);
+    }
+    const SeekIndexBlock &block = blocks.back();
+
+    SeekIndexPacket packet;
+    packet.dts_delta = (int32_t)(dts - block.base_dts);
+    packet.pts_offset = (int32_t)(pts - dts);
+    packet.size = size;
+    packet.offset_delta = (uint32_t)(offset - block.base_offset);
+    packet.stream = (uint8_t)stream;
+    packet.flags = keyframe ? SEEK_INDEX_FLAG_KEY : 0;
+    packet.reserved = 0;
+
+    if(keyframe && stream == key_stream) {
+        SeekIndexKeyframe key = {pts, (uint64_t)packets.size()};
+        keyframes.push_back(key);
+    }
+    packets.push_back(packet);
+}
+
+void seek_index_writer::clear() {
+    blocks.clear();
+    packets.clear();
+    keyframes.clear();
+}
+
+size_t seek_index_writer::size() {
+    return packets.size();
+}
+
+int32_t seek_index_writer::write(const char *output_file) {
+    FILE *file = fopen(output_file, "wb");
+    if(file == nullptr) {
+        std::cerr << "Error: could not open seek index " << output_file << std::endl;
+        return -1;
+    }
+
+    SeekIndexHeader header;
+    memcpy(header.magic, SEEK_INDEX_MAGIC, 4);
+    header.version = SEEK_INDEX_VERSION;
+    header.block_size = SEEK_INDEX_BLOCK_SIZE;
+    header.time_scale = time_scale;
+    header.byte_order = SEEK_INDEX_BYTE_ORDER;
+    header.reserved = 0;
+    header.packet_count = packets.size();
+    header.keyframe_count = keyframes.size();
+
+    static const char padding[8] = {0};
+    size_t pad = packets_bytes(packets.size()) - packets.size() * sizeof(SeekIndexPacket);
+
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(blocks.data(), sizeof(SeekIndexBlock), blocks.size(), file);
+    fwrite(packets.data(), sizeof(SeekIndexPacket), packets.size(), file);
+    fwrite(padding, 1, pad, file);
+    fwrite(keyframes.data(), sizeof(SeekIndexKeyframe), keyframes.size(), file);
+
+    int32_t result = ferror(file) ? -1 : 0;
+    fclose(file);
+    return result;
+}
+
+seek_index::seek_index() {
+}
+
+seek_index::~seek_index() {
+    close();
+}
+
+int32_t seek_index::open(const char *index_file) {
+    close();
+
+    int fd = ::open(index_file, O_RDONLY);
+    if(fd < 0) {
+        std::cerr << "Error: could not open seek index " << index_file << std::endl;
+        return -1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SeekIndexHeader)) {
+        std::cerr << "Error: invalid seek index " << index_file << std::endl;
+        ::close(fd);
+        return -1;
+    }
+
+    mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(mapping == MAP_FAILED) {
+        mapping = nullptr;
+        std::cerr << "Error: mmap seek index failed." << std::endl;
+        return -1;
+    }
+    mapping_size = st.st_size;
+
+    header = (const SeekIndexHeader *)mapping;
+    if(memcmp(header->magic, SEEK_INDEX_MAGIC, 4) == 0 && header->byte_order != SEEK_INDEX_BYTE_ORDER) {
+        std::cerr << "Error: seek index " << index_file << " was written with a different byte order." << std::endl;
+        close();
+        return -1;
+    }
+    uint64_t block_count = (header->packet_count + SEEK_INDEX_BLOCK_SIZE - 1) / SEEK_INDEX_BLOCK_SIZE;
+    size_t expected = sizeof(SeekIndexHeader) + block_count * sizeof(SeekIndexBlock)
+                      + packets_bytes(header->packet_count) + header->keyframe_count * sizeof(SeekIndexKeyframe);
+    if(memcmp(header->magic, SEEK_INDEX_MAGIC, 4) != 0 || header->version != SEEK_INDEX_VERSION
+       || header->block_size != SEEK_INDEX_BLOCK_SIZE || expected > mapping_size) {
+        std::cerr << "Error: invalid seek index " << index_file << std::endl;
+        close();
+        return -1;
+    }
+
+    blocks = (const SeekIndexBlock *)(header + 1);
+    packets = (const SeekIndexPacket *)(blocks + block_count);
+    keyframes = (const SeekIndexKeyframe *)((const char *)packets + packets_bytes(header->packet_count));
+    return 0;
+}
+
+void seek_index::close() {
+    if(mapping) {
+        munmap(mapping, mapping_size);
+    }
+    mapping = nullptr;
+    mapping_size = 0;
+    header = nullptr;
+    blocks = nullptr;
+    packets = nullptr;
+    keyframes = nullptr;
+}
+
+uint32_t seek_index::time_scale() {
+    return header ? header->time_scale : 0;
+}
+
+uint64_t seek_index::packet_count() {
+    return header ? header->packet_count : 0;
+}
+
+uint64_t seek_index::keyframe_count() {
+    return header ? header->keyframe_count : 0;
+}
+
+int32_t seek_index::packet(uint64_t index, SeekIndexEntry *entry) {
+    if(!header || index >= header->packet_count) {
+        return -1;
+    }
+
+    const SeekIndexBlock &block = blocks[index / SEEK_INDEX_BLOCK_SIZE];
+    const SeekIndexPacket &packet = packets[index];
+    entry->dts = block.base_dts + packet.dts_delta;
+    entry->pts = entry->dts + packet.pts_offset;
+    entry->offset = block.base_offset + packet.offset_delta;
+    entry->size = packet.size;
+    entry->stream = packet.stream;
+    entry->keyframe = packet.flags & SEEK_INDEX_FLAG_KEY;
+    return 0;
+}
+
+int64_t seek_index::find_keyframe(int64_t time) {
+    if(!header || header->keyframe_count == 0 || keyframes[0].pts > time) {
+        return -1;
+    }
+
+    // 关键帧按pts递增，二分查找
+    uint64_t low = 0, high = header->keyframe_count;
+    while(high - low > 1) {
+        uint64_t mid = low + (high - low) / 2;
+        if(keyframes[mid].pts <= time) {
+            low = mid;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+int32_t seek_index::gop_range(int64_t time, SeekIndexRange *range) {
+    int64_t key = find_keyframe(time);
+    if(key < 0) {
+        return -1;
+    }
+
+    SeekIndexEntry first, last;
+    range->first_packet = keyframes[key].packet;
+    range->end_packet = (uint64_t)key + 1 < header->keyframe_count ? keyframes[key + 1].packet : header->packet_count;
+    range->start_pts = keyframes[key].pts;
+
+    packet(range->first_packet, &first);
+    packet(range->end_packet - 1, &last);
+    range->byte_begin = first.offset;
+    range->byte_end = last.offset + last.size;
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <iostream>
+
+extern "C" {
+    #include <libswscale/swscale.h>
+}
+
+#include <opencv2/opencv.hpp>
+#include "video_thumbnailer.h"
+#include "video_trace.h"
+
+static std::string numbered_path(const std::string &prefix, const char *tag, int index) {
+    char name[32];
+    snprintf(name, sizeof(name), "%s%04d.jpg", tag, index);
+    return prefix + name;
+}
+
+video_thumbnailer::video_thumbnailer(const ThumbnailConfig &config) {
+    this->config = config;
+    if(this->config.interval <= 0) {
+        this->config.interval = 1;
+    }
+    if(this->config.columns <= 0) {
+        this->config.columns = 1;
+    }
+    if(this->config.rows <= 0) {
+        this->config.rows = 1;
+    }
+    if(this->config.max_pending == 0) {
+        this->config.max_pending = 1;
+    }
+    worker = std::thread(&video_thumbnailer::worker_loop, this);
+}
+
+video_thumbnailer::~video_thumbnailer() {
+    finish();
+    sws_freeContext(sws_ctx);
+}
+
+bool video_thumbnailer::should_sample(int64_t frame_index, bool keyframe) {
+    if(config.mode == THUMBNAIL_KEYFRAME) {
+        return keyframe;
+    }
+    return frame_index % config.interval == 0;
+}
+
+bool video_thumbnailer::samples_keyframes() {
+    return config.mode == THUMBNAIL_KEYFRAME;
+}
+
+void video_thumbnailer::push(const AVFrame *frame, double time) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(finishing || pending.size() >= config.max_pending) {
+        return;
+    }
+
+    AVFrame *ref = av_frame_alloc();
+    if(!ref || av_frame_ref(ref, frame) < 0) {
+        av_frame_free(&ref);
+        return;
+    }
+    pending.push_back(std::make_pair(ref, time));
+    cond.notify_one();
+}
+
+void video_thumbnailer::finish() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(finished) {
+            return;
+        }
+        finishing = true;
+    }
+    cond.notify_one();
+    worker.join();
+
+    write_sheet();
+    write_manifest();
+    finished = true;
+}
+
+void video_thumbnailer::worker_loop() {
+    video_trace::set_thread_name("thumbnailer");
+    while(1) {
+        std::pair<AVFrame *, double> item;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this]{ return finishing || !pending.empty(); });
+            if(pending.empty()) {
+                return;
+            }
+            item = pending.front();
+            pending.pop_front();
+        }
+        trace_span span("thumbnail");
+        process(item.first, item.second);
+        av_frame_free(&item.first);
+    }
+}
+
+void video_thumbnailer::process(AVFrame *frame, double time) {
+    int width = config.thumb_size.width, height = config.thumb_size.height;
+
+    // 直接从I420平面面积缩放并转为BGR
+    sws_ctx = sws_getCachedContext(sws_ctx, frame->width, frame->height, (AVPixelFormat)frame->format,
+                                   width, height, AV_PIX_FMT_BGR24, SWS_AREA, nullptr, nullptr, nullptr);
+    if(!sws_ctx) {
+        std::cerr << "Error: could not create thumbnail scaler." << std::endl;
+        return;
+    }
+
+    cv::Mat thumb(height, width, CV_8UC3);
+    uint8_t *dst_data[1] = {thumb.data};
+    int dst_linesize[1] = {(int)thumb.step};
+    sws_scale(sws_ctx, frame->data, frame->linesize, 0, frame->height, dst_data, dst_linesize);
+
+    int index = (int)entries.size();
+    cv::imwrite(numbered_path(config.output_prefix, "_", index + 1), thumb);
+
+    int per_sheet = config.columns * config.rows;
+    int tile = index % per_sheet;
+    if(tile == 0) {
+        if(!sheet.empty()) {
+            write_sheet();
+        }
+        sheet = cv::Mat::zeros(height * config.rows, width * config.columns, CV_8UC3);
+        sheet_index = index / per_sheet + 1;
+    }
+
+    ThumbnailEntry entry;
+    entry.time = time;
+    entry.sheet = sheet_index;
+    entry.x = (tile % config.columns) * width;
+    entry.y = (tile / config.columns) * height;
+    thumb.copyTo(sheet(cv::Rect(entry.x, entry.y, width, height)));
+    entries.push_back(entry);
+}
+
+void video_thumbnailer::write_sheet() {
+    if(sheet.empty()) {
+        return;
+    }
+    cv::imwrite(numbered_path(config.output_prefix, "_sheet_", sheet_index), sheet);
+    sheet.release();
+}
+
+void video_thumbnailer::write_manifest() {
+    std::string path = config.output_prefix + ".json";
+    FILE *file = fopen(path.c_str(), "w");
+    if(file == nullptr) {
+        std::cerr << "Error: could not open thumbnail manifest " << path << std::endl;
+        return;
+    }
+
+    fprintf(file, "{\n  \"width\": %d,\n  \"height\": %d,\n  \"columns\": %d,\n  \"rows\": %d,\n  \"thumbnails\": [\n",
+            config.thumb_size.width, config.thumb_size.height, config.columns, config.rows);
+    for(size_t i = 0; i < entries.size(); i++) {
+        const ThumbnailEntry &entry = entries[i];
+        fprintf(file, "    {\"time\": %.3f, \"file\": \"%s\", \"sheet\": \"%s\", \"x\": %d, \"y\": %d}%s\n",
+                entry.time, numbered_path(config.output_prefix, "_", i + 1).c_str(),
+                numbered_path(config.output_prefix, "_sheet_", entry.sheet).c_str(),
+                entry.x, entry.y, i + 1 < entries.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+}
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <iostream>
+
+#include "video_trace.h"
+
+typedef struct {
+    TraceEvent events[TRACE_CHUNK_EVENTS];
+    std::atomic<uint32_t> count;
+}TraceChunk;
+
+// 单个线程的事件缓存，只有所属线程写入，导出时按已发布的数量读取
+typedef struct {
+    uint32_t tid;
+    std::string name;
+    TraceChunk *chunks[TRACE_MAX_CHUNKS];
+    std::atomic<uint32_t> chunk_count;
+    std::atomic<uint64_t> dropped;
+    std::atomic<bool> exited;
+}TraceThread;
+
+// 线程退出时标记其缓存，由reset回收
+class trace_thread_holder {
+    public:
+        TraceThread *thread = nullptr;
+        ~trace_thread_holder() {
+            if(thread) {
+                thread->exited.store(true, std::memory_order_release);
+            }
+        }
+};
+
+std::atomic<bool> video_trace::active(false);
+
+static std::atomic<int64_t> trace_epoch(0);
+static std::mutex threads_mutex;
+static std::vector<TraceThread *> trace_threads;
+static uint32_t next_tid = 1;
+// 线程退出后缓存保留到reset，仍可导出
+static thread_local trace_thread_holder current_thread;
+// 未启用跟踪时只保存名称，不分配缓存
+static thread_local const char *current_name = nullptr;
+
+static int64_t steady_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static TraceThread *thread_buffer() {
+    if(current_thread.thread == nullptr) {
+        TraceThread *thread = new TraceThread();
+        thread->chunk_count.store(0);
+        thread->dropped.store(0);
+        thread->exited.store(false);
+        if(current_name) {
+            thread->name = current_name;
+        }
+        std::lock_guard<std::mutex> lock(threads_mutex);
+        thread->tid = next_tid++;
+        trace_threads.push_back(thread);
+        current_thread.thread = thread;
+    }
+    return current_thread.thread;
+}
+
+void video_trace::enable(bool enable) {
+    if(enable) {
+        int64_t expected = 0;
+        trace_epoch.compare_exchange_strong(expected, steady_ns());
+    }
+    active.store(enable, std::memory_order_relaxed);
+}
+
+int64_t video_trace::now() {
+    return steady_ns() - trace_epoch.load(std::memory_order_relaxed);
+}
+
+void video_trace::record(const char *name, int64_t begin, int64_t end, int64_t arg) {
+    TraceThread *thread = thread_buffer();
+
+    uint32_t chunk_count = thread->chunk_count.load(std::memory_order_relaxed);
+    TraceChunk *chunk = chunk_count > 0 ? thread->chunks[chunk_count - 1] : nullptr;
+    if(chunk == nullptr || chunk->count.load(std::memory_order_relaxed) == TRACE_CHUNK_EVENTS) {
+        // 超过上限后丢弃，避免长时间运行占满内存
+        if(chunk_count == TRACE_MAX_CHUNKS) {
+            thread->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        chunk = new TraceChunk();
+        chunk->count.store(0, std::memory_order_relaxed);
+        thread->chunks[chunk_count] = chunk;
+        thread->chunk_count.store(chunk_count + 1, std::memory_order_release);
+    }
+
+    uint32_t index = chunk->count.load(std::memory_order_relaxed);
+    TraceEvent &event = chunk->events[index];
+    event.name = name;
+    event.begin = begin;
+    event.end = end;
+    event.arg = arg;
+    chunk->count.store(index + 1, std::memory_order_release);
+}
+
+void video_trace::set_thread_name(const char *name) {
+    current_name = name;
+    TraceThread *thread = current_thread.thread;
+    if(thread) {
+        std::lock_guard<std::mutex> lock(threads_mutex);
+        thread->name = name;
+    }
+}
+
+void video_trace::reset() {
+    std::lock_guard<std::mutex> lock(threads_mutex);
+    size_t kept = 0;
+    for(size_t t = 0; t < trace_threads.size(); t++) {
+        TraceThread *thread = trace_threads[t];
+        if(!thread->exited.load(std::memory_order_acquire)) {
+            trace_threads[kept++] = thread;
+            continue;
+        }
+        uint32_t chunk_count = thread->chunk_count.load(std::memory_order_acquire);
+        for(uint32_t c = 0; c < chunk_count; c++) {
+            delete thread->chunks[c];
+        }
+        delete thread;
+    }
+    trace_threads.resize(kept);
+}
+
+// 线程名由调用方设置，按JSON字符串转义引号、反斜杠与控制字符
+static void write_json_string(FILE *output, const char *text) {
+    fputc('"', output);
+    for(const unsigned char *c = (const unsigned char *)text; *c; c++) {
+        if(*c == '"' || *c == '\\') {
+            fprintf(output, "\\%c", *c);
+        }
+        else if(*c < 0x20) {
+            fprintf(output, "\\u%04x", *c);
+        }
+        else {
+            fputc(*c, output);
+        }
+    }
+    fputc('"', output);
+}
+
+int32_t video_trace::write(const char *trace_file) {
+    FILE *output = fopen(trace_file, "w");
+    if(output == nullptr) {
+        std::cerr << "Error: could not open trace file " << trace_file << std::endl;
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(threads_mutex);
+    uint64_t dropped = 0;
+    bool first = true;
+    fprintf(output, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for(size_t t = 0; t < trace_threads.size(); t++) {
+        TraceThread *thread = trace_threads[t];
+        dropped += thread->dropped.load(std::memory_order_relaxed);
+        if(!thread->name.empty()) {
+            fprintf(output, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":",
+                    first ? "" : ",\n", thread->tid);
+            write_json_string(output, thread->name.c_str());
+            fprintf(output, "}}");
+            first = false;
+        }
+
+        uint32_t chunk_count = thread->chunk_count.load(std::memory_order_acquire);
+        for(uint32_t c = 0; c < chunk_count; c++) {
+            TraceChunk *chunk = thread->chunks[c];
+            uint32_t count = chunk->count.load(std::memory_order_acquire);
+            for(uint32_t i = 0; i < count; i++) {
+                const TraceEvent &event = chunk->events[i];
+                // trace-event时间单位为微秒
+                fprintf(output, "%s{\"name\":\"%s\",\"cat\":\"video_writer\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                        first ? "" : ",\n", event.name, thread->tid, event.begin / 1000.0, (event.end - event.begin) / 1000.0);
+                if(event.arg >= 0) {
+                    fprintf(output, ",\"args\":{\"value\":%lld}", (long long)event.arg);
+                }
+                fprintf(output, "}");
+                first = false;
+            }
+        }
+    }
+    fprintf(output, "\n]}\n");
+    bool failed = ferror(output);
+    fclose(output);
+
+    if(dropped > 0) {
+        std::cerr << "Warning: " << dropped << " trace events were dropped." << std::endl;
+    }
+    return failed ? -1 : 0;
+}
@@ -5,15 +5,26 @@
 #include <dirent.h>
 #include <fnmatch.h>
 #include <functional>
+#include <memory>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 extern "C" {
     #include <libavformat/avformat.h>
     #include <libswscale/swscale.h>
     #include <libavutil/imgutils.h>
     #include <libavutil/opt.h>
+    #include <libavutil/samplefmt.h>
+    #include <libavutil/channel_layout.h>
+    #include <libswresample/swresample.h>
 }
 
 #include "video_writer_core.h"
+#include "video_mux_target.h"
+#include "video_audio_file.h"
+#include "video_encoder_calibration.h"
+#include <chrono>
 #include <opencv2/core/core.hpp>
 
 static size_t buffer_write(void *ptr, size_t size, size_t nmemb, MemoryBuffer *buffer) {
@@ -28,6 +39,9 @@ static size_t buffer_write(void *ptr, size_t size, size_t nmemb, MemoryBuffer *b
             std::cerr << "Error: realloc error." << std::endl;
             exit(EXIT_FAILURE);
         }
+        if(buffer->budget) {
+            buffer->budget->charge(new_capacity - buffer->capacity);
+        }
         buffer->capacity = new_capacity;
     }
 
@@ -38,18 +52,42 @@ static size_t buffer_write(void *ptr, size_t size, size_t nmemb, MemoryBuffer *b
     return 0;
 }
 
-int32_t video_writer::encoder_yuv_to_h264(bool flushing) {
+// 交错PCM拆分到平面格式的frame，src为nb_samples * channels个采样
+static void deinterleave_audio(AVFrame *frame, const uint8_t *src, int channels, size_t data_size) {
+    for(int i = 0; i < frame->nb_samples; i++) {
+        for(int ch = 0; ch < channels; ch++) {
+            memcpy(frame->data[ch] + data_size * i, src, data_size);
+            src += data_size;
+        }
+    }
+}
+
+int32_t video_writer::encoder_yuv_to_h264(AVFrame *frame) {
     int32_t result = 0;
-    std::cout << "Send frame to encoder with pts:" << video_frame->pts << std::endl;
+    bool flushing = frame == nullptr;
+    if(!flushing) {
+        std::cout << "Send frame to encoder with pts:" << frame->pts << std::endl;
+        // 记录送入时间，收到同pts的包时得到编码器重排延迟
+        if(video_trace::enabled()) {
+            trace_send_times.push_back(std::make_pair(frame->pts, video_trace::now()));
+        }
+    }
 
-    result = avcodec_send_frame(video_codec_ctx, flushing ? nullptr : video_frame);
+    {
+        trace_span span("video_send_frame", flushing ? -1 : frame->pts);
+        result = avcodec_send_frame(video_codec_ctx, frame);
+    }
     if(result < 0) {
         std::cerr << "Error: avcodec_send_frame failed." << std::endl;
         return result;
     }
     while(result >= 0) {
+        trace_span span("video_receive_packet");
         result = avcodec_receive_packet(video_codec_ctx, video_pkt);
         if(result == AVERROR(EAGAIN) || result == AVERROR_EOF) {
+            if(flushing) {
+                trace_send_times.clear();
+            }
             return 1;
         }
         else if(result < 0) {
@@ -59,7 +97,23 @@ int32_t video_writer::encoder_yuv_to_h264(bool flushing) {
 
         if(flushing) std::cout<<"Flushing: ";
         std::cout << "Got encoded packet with dts:" << video_pkt->dts << ", pts:" << video_pkt->pts << ", " << std::endl;
+        int64_t offset = video_buffer->size;
         buffer_write(video_pkt->data, 1, video_pkt->size, video_buffer);
+        h264_index.add(0, av_rescale_q(video_pkt->pts, video_time_base, (AVRational){1, SEEK_INDEX_TIME_SCALE}),
+                       av_rescale_q(video_pkt->dts, video_time_base, (AVRational){1, SEEK_INDEX_TIME_SCALE}),
+                       video_pkt->size, offset, video_pkt->flags & AV_PKT_FLAG_KEY);
+
+        // 记录包时间戳，h264裸流不携带时间信息
+        PacketTiming timing = {video_pkt->pts, video_pkt->dts, video_pkt->duration, video_pkt->size, video_pkt->flags};
+        video_packet_timings.push_back(timing);
+
+        for(size_t i = 0; i < trace_send_times.size(); i++) {
+            if(trace_send_times[i].first == video_pkt->pts) {
+                video_trace::record("encoder_latency", trace_send_times[i].second, video_trace::now(), video_pkt->pts);
+                trace_send_times.erase(trace_send_times.begin() + i);
+                break;
+            }
+        }
     }
     return 0;
 }
@@ -96,149 +150,1292 @@ static void get_adts_header(AVCodecContext* ctx, uint8_t* adts_header, int aac_l
 }
 
 int32_t video_writer::encoder_pcm_to_aac(bool flushing) {
+    trace_span span("aac_encode", flushing ? -1 : audio_sample_pts);
     int32_t result = 0;
+    if(!flushing) {
+        audio_frame->pts = audio_sample_pts;
+        audio_sample_pts += audio_frame->nb_samples;
+    }
     result = avcodec_send_frame(audio_codec_ctx, flushing ? nullptr : audio_frame);
     if(result < 0) {
         std::cerr << "Error: avcodec_send_frame failed." << std::endl;
         return result;
     }
 
-    while(result >= 0) {
-        result = avcodec_receive_packet(audio_codec_ctx, audio_pkt);
-        if(result == AVERROR(EAGAIN) || result == AVERROR_EOF) {
-            return 1;
+    while(result >= 0) {
+        result = avcodec_receive_packet(audio_codec_ctx, audio_pkt);
+        if(result == AVERROR(EAGAIN) || result == AVERROR_EOF) {
+            return 1;
+        }
+        else if(result < 0) {
+            std::cerr << "Error: avcodec_receive_packet failed." << std::endl;
+            return result;
+        }
+        if(flushing) {
+            std::cout << "Flushing!" << std::endl;
+        }
+
+        uint8_t aac_header[7];
+        get_adts_header(audio_codec_ctx, aac_header, audio_pkt->size);
+
+        int64_t offset = audio_buffer->size;
+        buffer_write(aac_header, 1, 7, audio_buffer);
+        buffer_write(audio_pkt->data, 1, audio_pkt->size, audio_buffer);
+        int64_t audio_pts = av_rescale_q(audio_pkt->pts, audio_codec_ctx->time_base, (AVRational){1, SEEK_INDEX_TIME_SCALE});
+        aac_index.add(0, audio_pts, audio_pts, audio_pkt->size + 7, offset, true);
+    }
+    return 0;
+}
+
+// BGR图像的rect区域转换为YUV420写入frame对应位置，rect需为偶数对齐
+static void convert_region(const cv::Mat &inMat, const cv::Rect &rect, AVFrame *frame) {
+    cv::Mat yuv;
+    cv::cvtColor(inMat(rect), yuv, cv::COLOR_BGR2YUV_I420);
+
+    int w = rect.width, h = rect.height;
+    const uint8_t *src = yuv.data;
+    for(int row = 0; row < h; row++) {
+        memcpy(frame->data[0] + (rect.y + row) * frame->linesize[0] + rect.x, src + row * w, w);
+    }
+    src += w * h;
+    for(int plane = 1; plane <= 2; plane++) {
+        for(int row = 0; row < h / 2; row++) {
+            memcpy(frame->data[plane] + (rect.y / 2 + row) * frame->linesize[plane] + rect.x / 2, src + row * w / 2, w / 2);
+        }
+        src += w * h / 4;
+    }
+}
+
+int32_t video_writer::cvmat_to_avframe(cv::Mat &inMat, int64_t pts, int64_t duration,
+                                       const std::vector<cv::Rect> *dirty_rects, const std::vector<RoiHint> *rois)
+{
+    int ret = check_output_limit();
+    if(ret < 0) {
+        av_frame_unref(previous_frame);
+        return ret;
+    }
+
+    // 同步输入在转换与编码期间计入预算，异步任务已在submit中计入
+    size_t frame_bytes = inMat.total() * inMat.elemSize();
+    if(!input_prepaid) {
+        ret = budget.wait_and_charge(frame_bytes);
+        if(ret < 0) {
+            av_frame_unref(previous_frame);
+            return ret;
+        }
+    }
+    ret = convert_video_frame(inMat, pts, duration, dirty_rects, rois);
+    if(!input_prepaid) {
+        budget.release(frame_bytes);
+    }
+    return ret;
+}
+
+int32_t video_writer::check_output_limit() {
+    // 常驻输出只会增长，超过限额后等待也不会释放，直接失败
+    if(output_budget.over_limit()) {
+        std::cerr << "Error: encoded output exceeds its memory limit of " << output_budget.get_limit() << " bytes." << std::endl;
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+int32_t video_writer::convert_video_frame(cv::Mat &inMat, int64_t pts, int64_t duration,
+                                          const std::vector<cv::Rect> *dirty_rects, const std::vector<RoiHint> *rois)
+{
+    // 得到Mat信息
+    AVPixelFormat dstFormat = AV_PIX_FMT_YUV420P;
+    int width = inMat.cols;
+    int height = inMat.rows;
+    int ret = 0;
+
+    // 统计每帧转换与编码的耗时，跟不上帧率时切换到更快的preset
+    if(realtime_step_down && !spool) {
+        ret = check_realtime();
+        if(ret < 0) {
+            av_frame_unref(previous_frame);
+            return ret;
+        }
+    }
+    std::chrono::steady_clock::time_point frame_start = std::chrono::steady_clock::now();
+
+
+
+
+
+
+
+    // 有变化区域时复用上一帧的YUV数据，叠加层会改变未变化区域，此时按整帧转换
+    // 上一帧混合过叠加层时其YUV已包含叠加内容，叠加层移除后也需整帧转换一次
+    bool blending = !overlay.empty();
+    bool partial = dirty_rects && previous_frame->buf[0] && previous_frame->width == width
+                   && previous_frame->height == height && !blending && !previous_blended;
+    if(partial) {
+        // 上一帧只剩这里的引用时不拷贝，直接在原缓存上更新
+        av_frame_move_ref(video_frame, previous_frame);
+        av_frame_remove_side_data(video_frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    }
+    else {
+        video_frame->width = width;
+        video_frame->height = height;
+        video_frame->format = dstFormat;
+
+        ret = av_frame_get_buffer(video_frame, 0);
+        if (ret < 0) 
+        {
+            std::cerr << "Could not allocate the video frame data." << std::endl;
+            av_frame_unref(previous_frame);
+            return -1; 
+        }
+    }
+    ret = av_frame_make_writable(video_frame);
+    if(ret < 0) 
+    {
+        std::cerr << "Av frame make writable failed." << std::endl;
+        av_frame_unref(video_frame);
+        av_frame_unref(previous_frame);
+        return -1;
+    }
+
+    {
+        trace_span span("convert", video_frame_count);
+
+        if(partial) {
+            // 只转换变化区域，坐标对齐到2以匹配色度平面
+            cv::Rect frame_rect(0, 0, width, height);
+            for(size_t i = 0; i < dirty_rects->size(); i++) {
+                const cv::Rect &dirty = (*dirty_rects)[i];
+                int x0 = dirty.x & ~1, y0 = dirty.y & ~1;
+                int x1 = (dirty.x + dirty.width + 1) & ~1, y1 = (dirty.y + dirty.height + 1) & ~1;
+                cv::Rect rect = cv::Rect(x0, y0, x1 - x0, y1 - y0) & frame_rect;
+                if(rect.width >= 2 && rect.height >= 2) {
+                    convert_region(inMat, cv::Rect(rect.x, rect.y, rect.width & ~1, rect.height & ~1), video_frame);
+                }
+            }
+        }
+        else {
+            // 转换颜色空间为YUV420
+            // cv::setNumThreads(1)
+            cv::cvtColor(inMat, inMat, cv::COLOR_BGR2YUV_I420);
+
+            // 按YUV420格式，设置数据地址
+            int frame_size = width * height;
+            unsigned char *data = inMat.data;
+            memcpy(video_frame->data[0], data, frame_size);
+            memcpy(video_frame->data[1], data + frame_size, frame_size / 4);
+            memcpy(video_frame->data[2], data + frame_size * 5 / 4, frame_size / 4);
+        }
+
+        // 叠加水印、字幕等，只处理被覆盖的像素
+        if(blending) {
+            overlay.blend(video_frame);
+        }
+    }
+
+    // 使用过变化区域后一直保留上一帧，供下一帧复用
+    if(dirty_rects || previous_frame->buf[0]) {
+        av_frame_unref(previous_frame);
+        av_frame_ref(previous_frame, video_frame);
+        previous_blended = blending;
+    }
+
+    // 质量区域作为side data交给编码器，libx264按qoffset调整各宏块的量化
+    if(rois && !rois->empty()) {
+        ret = attach_roi(*rois);
+        if(ret < 0) {
+            av_frame_unref(video_frame);
+            av_frame_unref(previous_frame);
+            return ret;
+        }
+    }
+
+    // 快速采集模式只写入磁盘缓存，编码推迟到transcode_spool
+    if(spool) {
+        trace_span span("spool_append", video_frame_count);
+        ret = spool->append(video_frame, pts, duration);
+        if(ret < 0) {
+            av_frame_unref(previous_frame);
+        }
+        last_video_pts = pts;
+        last_video_duration = duration;
+        frame_pts = pts + duration;
+        video_frame_count++;
+        av_frame_unref(video_frame);
+        return ret;
+    }
+
+    ret = encode_video_frame(pts, duration);
+    double frame_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - frame_start).count();
+    frame_seconds_average = frame_seconds_average == 0 ? frame_seconds : frame_seconds_average * 0.9 + frame_seconds * 0.1;
+    return ret;
+}
+
+int32_t video_writer::check_realtime() {
+    // 切换后至少观察1秒，等新编码器的平均耗时稳定
+    frames_since_step++;
+    if(frames_since_step < STREAM_FRAME_RATE || frame_seconds_average <= 1.0 / STREAM_FRAME_RATE) {
+        return 0;
+    }
+
+    int index = preset_index(encoder_config.preset);
+    if(index < 0 || index + 1 >= ENCODER_PRESET_COUNT) {
+        return 0;
+    }
+
+    std::cout << "Encoder falls behind " << STREAM_FRAME_RATE << " fps with " << 1.0 / frame_seconds_average
+              << " fps, switch preset from " << encoder_config.preset << " to " << ENCODER_PRESETS[index + 1] << std::endl;
+    encoder_config.preset = ENCODER_PRESETS[index + 1];
+    frames_since_step = 0;
+    frame_seconds_average = 0;
+
+    // 缓存模式下每个GOP都会重建编码器，新preset从下一个GOP开始生效
+    if(render_cache) {
+        return 0;
+    }
+    // 先输出旧编码器中的帧，新编码器从IDR开始
+    int32_t result = encoder_yuv_to_h264(nullptr);
+    if(result < 0) {
+        std::cerr << "Error: could not flush the encoder before switching preset." << std::endl;
+        return result;
+    }
+    result = reset_video_encoder();
+    if(result < 0) {
+        std::cerr << "Error: could not reopen the encoder with preset " << encoder_config.preset << std::endl;
+        return result;
+    }
+    frames_since_keyframe = keyframe_max_interval;
+    return 0;
+}
+
+int32_t video_writer::encode_video_frame(int64_t pts, int64_t duration) {
+    bool keyframe = place_keyframe();
+
+    // 引用已转换的帧交给后台生成缩略图
+    // 缓存模式下按关键帧采样时，由encode_cached_gop按输出包的关键帧标记采样
+    if(thumbnailer && !(render_cache && thumbnailer->samples_keyframes())) {
+        if(thumbnailer->should_sample(video_frame_count, keyframe)) {
+            thumbnailer->push(video_frame, pts * av_q2d(video_time_base));
+        }
+    }
+    video_frame_count++;
+
+    video_frame->pts = pts;
+    last_video_pts = pts;
+    last_video_duration = duration;
+    frame_pts = pts + duration;
+
+    if(render_cache) {
+        cache_video_frame();
+    }
+    else {
+        encoder_yuv_to_h264(video_frame);
+    }
+
+    av_frame_unref(video_frame);
+    
+    return 0;
+}
+
+int32_t video_writer::flush() {
+    // 采集模式下结束磁盘缓存，不经过编码器
+    if(spool) {
+        return spool->finish();
+    }
+    // 缓存模式下每个GOP单独编码并已刷新，只需处理最后不足一个GOP的帧
+    if(render_cache) {
+        return encode_cached_gop();
+    }
+    int32_t result = encoder_yuv_to_h264(nullptr);
+    return result < 0 ? result : 0;
+}
+
+std::string video_writer::encoder_settings_key() {
+    char key[256];
+    snprintf(key, sizeof(key), "v%d|%s|%s|%lld|%d|%d|%d|%d|%d|%dx%d|%d/%d", GOP_CACHE_VERSION, video_codec->name,
+             encoder_config.preset.c_str(), (long long)encoder_config.bit_rate, encoder_config.gop_size,
+             encoder_config.max_b_frames, encoder_config.crf, encoder_config.thread_count, realtime_step_down,
+             frame_size.width, frame_size.height, video_time_base.num, video_time_base.den);
+    return std::string(key);
+}
+
+int32_t video_writer::cache_video_frame() {
+    // 逐行计算两路独立的128位哈希，跳过linesize中的填充字节
+    GopCacheKey hash = {0, 0x9E3779B97F4A7C15ULL};
+    for(int plane = 0; plane < 3; plane++) {
+        int width = plane == 0 ? video_frame->width : (video_frame->width + 1) / 2;
+        int height = plane == 0 ? video_frame->height : (video_frame->height + 1) / 2;
+        for(int row = 0; row < height; row++) {
+            const uint8_t *line = video_frame->data[plane] + row * video_frame->linesize[plane];
+            hash.high = content_hash(line, width, hash.high);
+            hash.low = content_hash(line, width, hash.low);
+        }
+    }
+    hash.high = content_hash(&last_video_duration, sizeof(last_video_duration), hash.high);
+    hash.low = content_hash(&last_video_duration, sizeof(last_video_duration), hash.low);
+    // 质量区域影响编码结果，ROI不同的帧不能复用同一GOP
+    AVFrameSideData *roi = av_frame_get_side_data(video_frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    if(roi) {
+        hash.high = content_hash(roi->data, roi->size, hash.high);
+        hash.low = content_hash(roi->data, roi->size, hash.low);
+    }
+
+    AVFrame *frame = av_frame_clone(video_frame);
+    if(!frame) {
+        std::cerr << "Error: could not reference frame for gop cache." << std::endl;
+        return -1;
+    }
+
+    size_t frame_bytes = (size_t)video_frame->width * video_frame->height * 3 / 2;
+    budget.charge(frame_bytes);
+    pending_gop_bytes += frame_bytes;
+    pending_gop.push_back(frame);
+    pending_gop_hashes.push_back(hash);
+
+    // 内容定义的边界：至少gop_size/2帧后，在帧哈希满足条件处结束GOP，最长2*gop_size帧
+    // 边界只取决于帧本身，插入或删除帧后后续边界会重新对齐，之后的GOP仍能命中缓存
+    int frames = pending_gop.size();
+    int min_frames = std::max(1, encoder_config.gop_size / 2);
+    int divisor = std::max(1, encoder_config.gop_size - min_frames);
+    if(frames >= 2 * std::max(1, encoder_config.gop_size) || (frames >= min_frames && hash.low % divisor == 0)) {
+        return encode_cached_gop();
+    }
+    return 0;
+}
+
+int32_t video_writer::encode_cached_gop() {
+    if(pending_gop.empty()) {
+        return 0;
+    }
+
+    // 缓存键由编码参数、每帧内容哈希与相对时间组成
+    int64_t base_pts = pending_gop[0]->pts;
+    std::string settings = encoder_settings_key();
+    std::vector<uint8_t> key_data(settings.begin(), settings.end());
+    for(size_t i = 0; i < pending_gop.size(); i++) {
+        int64_t words[3] = {(int64_t)pending_gop_hashes[i].high, (int64_t)pending_gop_hashes[i].low, pending_gop[i]->pts - base_pts};
+        key_data.insert(key_data.end(), (uint8_t *)words, (uint8_t *)words + sizeof(words));
+    }
+    GopCacheKey key;
+    key.high = content_hash(key_data.data(), key_data.size(), 1);
+    key.low = content_hash(key_data.data(), key_data.size(), 2);
+    GopCacheShape shape = {(uint32_t)pending_gop.size(), (uint32_t)pending_gop[0]->width, (uint32_t)pending_gop[0]->height, 0};
+
+    int32_t result = 0;
+    std::vector<uint8_t> data;
+    std::vector<PacketTiming> packets;
+    bool hit;
+    {
+        trace_span span("gop_cache_lookup", base_pts);
+        hit = render_cache->lookup(key, shape, data, packets);
+    }
+    if(hit) {
+        // 命中，直接拼接缓存的GOP码流
+        int64_t offset = video_buffer->size;
+        buffer_write(data.data(), 1, data.size(), video_buffer);
+        for(size_t i = 0; i < packets.size(); i++) {
+            PacketTiming timing = packets[i];
+            timing.pts += base_pts;
+            timing.dts += base_pts;
+            video_packet_timings.push_back(timing);
+            h264_index.add(0, av_rescale_q(timing.pts, video_time_base, (AVRational){1, SEEK_INDEX_TIME_SCALE}),
+                           av_rescale_q(timing.dts, video_time_base, (AVRational){1, SEEK_INDEX_TIME_SCALE}),
+                           timing.size, offset, timing.flags & AV_PKT_FLAG_KEY);
+            offset += timing.size;
+        }
+        cache_hits++;
+    }
+    else {
+        // 未命中，用新的编码器实例编码并刷新，保证GOP以IDR开始且不引用其他GOP
+        size_t data_begin = video_buffer->size;
+        size_t timing_begin = video_packet_timings.size();
+        result = reset_video_encoder();
+        if(result >= 0) {
+            for(size_t i = 0; i < pending_gop.size(); i++) {
+                encoder_yuv_to_h264(pending_gop[i]);
+            }
+            encoder_yuv_to_h264(nullptr);
+
+            for(size_t i = timing_begin; i < video_packet_timings.size(); i++) {
+                PacketTiming timing = video_packet_timings[i];
+                timing.pts -= base_pts;
+                timing.dts -= base_pts;
+                packets.push_back(timing);
+            }
+            // 编码器丢帧时包数与帧数不符，不写入缓存
+            if(packets.size() == shape.frame_count) {
+                render_cache->store(key, shape, (uint8_t *)video_buffer->buffer + data_begin, video_buffer->size - data_begin, packets);
+            }
+        }
+        cache_misses++;
+    }
+
+    if(thumbnailer && thumbnailer->samples_keyframes()) {
+        sample_gop_keyframes(packets, base_pts);
+    }
+
+    for(size_t i = 0; i < pending_gop.size(); i++) {
+        av_frame_free(&pending_gop[i]);
+    }
+    pending_gop.clear();
+    pending_gop_hashes.clear();
+    budget.release(pending_gop_bytes);
+    pending_gop_bytes = 0;
+
+    return result < 0 ? result : 0;
+}
+
+void video_writer::sample_gop_keyframes(const std::vector<PacketTiming> &packets, int64_t base_pts) {
+    // 包的pts相对GOP第一帧，按pts找回对应的帧
+    for(size_t i = 0; i < packets.size(); i++) {
+        if(!(packets[i].flags & AV_PKT_FLAG_KEY)) {
+            continue;
+        }
+        int64_t pts = base_pts + packets[i].pts;
+        for(size_t j = 0; j < pending_gop.size(); j++) {
+            if(pending_gop[j]->pts == pts) {
+                thumbnailer->push(pending_gop[j], pts * av_q2d(video_time_base));
+                break;
+            }
+        }
+    }
+}
+
+bool video_writer::place_keyframe() {
+    if(!detector) {
+        // 缓存模式下关键帧由GOP边界决定，不强制
+        if(render_cache) {
+            video_frame->pict_type = AV_PICTURE_TYPE_NONE;
+            return false;
+        }
+        // 在GOP整数倍处强制关键帧，重建编码器后也与返回值一致
+        bool keyframe = video_frame_count % video_codec_ctx->gop_size == 0;
+        video_frame->pict_type = keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+        return keyframe;
+    }
+
+    // 下采样亮度检测镜头切换，间隔不足min时忽略，达到max时强制
+    bool cut = detector->is_cut(video_frame->data[0], video_frame->linesize[0], video_frame->width, video_frame->height);
+    bool keyframe = video_frame_count == 0 || frames_since_keyframe >= keyframe_max_interval
+                    || (cut && frames_since_keyframe >= keyframe_min_interval);
+    if(keyframe) {
+        frames_since_keyframe = 0;
+    }
+    frames_since_keyframe++;
+
+    video_frame->pict_type = keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    return keyframe;
+}
+
+video_writer::video_writer() {
+    STREAM_FRAME_RATE = 25;
+    frame_size = cv::Size(1280, 720);
+
+    init();
+    init_video_encoder();
+    init_audio_encoder();
+}
+
+video_writer::video_writer(size_t frame_rate) {
+    STREAM_FRAME_RATE = frame_rate;
+    frame_size = cv::Size(1280, 720);
+
+    init();
+    init_video_encoder();
+    init_audio_encoder();
+}
+
+video_writer::video_writer(cv::Size image_size) {
+    STREAM_FRAME_RATE = 25;
+    frame_size = image_size;
+
+    init();
+    init_video_encoder();
+    init_audio_encoder();
+}
+
+video_writer::video_writer(size_t frame_rate, cv::Size image_size) {
+    STREAM_FRAME_RATE = frame_rate;
+    frame_size = image_size;
+
+    init();
+    init_video_encoder();
+    init_audio_encoder();
+}
+
+int32_t video_writer::input_image(cv::Mat png_image) {
+    int64_t duration = av_rescale_q(1, (AVRational){1, STREAM_FRAME_RATE}, video_time_base);
+    int32_t result = cvmat_to_avframe(png_image, frame_pts, duration);
+    return result < 0 ? result : 0;
+}
+
+int32_t video_writer::input_image_regions(cv::Mat png_image, const std::vector<cv::Rect> &dirty_rects, const std::vector<RoiHint> &rois) {
+    int64_t duration = av_rescale_q(1, (AVRational){1, STREAM_FRAME_RATE}, video_time_base);
+    int32_t result = cvmat_to_avframe(png_image, frame_pts, duration, &dirty_rects, &rois);
+    return result < 0 ? result : 0;
+}
+
+int32_t video_writer::input_image_roi(cv::Mat png_image, const std::vector<RoiHint> &rois) {
+    int64_t duration = av_rescale_q(1, (AVRational){1, STREAM_FRAME_RATE}, video_time_base);
+    int32_t result = cvmat_to_avframe(png_image, frame_pts, duration, nullptr, &rois);
+    return result < 0 ? result : 0;
+}
+
+int32_t video_writer::attach_roi(const std::vector<RoiHint> &rois) {
+    AVFrameSideData *side_data = av_frame_new_side_data(video_frame, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+                                                        rois.size() * sizeof(AVRegionOfInterest));
+    if(!side_data) {
+        std::cerr << "Error: could not attach regions of interest." << std::endl;
+        return -1;
+    }
+
+    // 同一宏块被多个区域覆盖时编码器使用第一个，按调用方给出的顺序排列
+    AVRegionOfInterest *regions = (AVRegionOfInterest *)side_data->data;
+    for(size_t i = 0; i < rois.size(); i++) {
+        float qoffset = std::max(-1.0f, std::min(1.0f, rois[i].qoffset));
+        regions[i].self_size = sizeof(AVRegionOfInterest);
+        regions[i].left = rois[i].rect.x;
+        regions[i].top = rois[i].rect.y;
+        regions[i].right = rois[i].rect.x + rois[i].rect.width;
+        regions[i].bottom = rois[i].rect.y + rois[i].rect.height;
+        regions[i].qoffset = av_make_q((int)(qoffset * 1000), 1000);
+    }
+    return 0;
+}
+
+int32_t video_writer::input_image(cv::Mat png_image, int64_t pts, AVRational time_base) {
+    int64_t video_pts = av_rescale_q(pts, time_base, video_time_base);
+    if(last_video_pts != AV_NOPTS_VALUE && video_pts <= last_video_pts) {
+        std::cerr << "Error: input image pts " << pts << " is not increasing." << std::endl;
+        return -1;
+    }
+
+    // 时长先按帧率估计，下一帧到来后由实际间隔决定
+    int64_t duration = av_rescale_q(1, (AVRational){1, STREAM_FRAME_RATE}, video_time_base);
+    return cvmat_to_avframe(png_image, video_pts, duration);
+}
+
+int32_t video_writer::input_image_duration(cv::Mat png_image, int64_t duration, AVRational time_base) {
+    int64_t video_duration = av_rescale_q(duration, time_base, video_time_base);
+    if(video_duration <= 0) {
+        std::cerr << "Error: input image duration " << duration << " is too small." << std::endl;
+        return -1;
+    }
+
+    return cvmat_to_avframe(png_image, frame_pts, video_duration);
+}
+
+int32_t video_writer::input_audio(char *audio_data, size_t size) {
+    if(spool) {
+        return spool->append_audio((uint8_t *)audio_data, size);
+    }
+
+    int32_t result = check_output_limit();
+    if(result < 0) {
+        return result;
+    }
+    // 同步输入在编码期间计入预算，异步任务已在submit中计入
+    if(!input_prepaid) {
+        result = budget.wait_and_charge(size);
+        if(result < 0) {
+            return result;
+        }
+    }
+
+    buffer_write(audio_data, 1, size, audio_buffer_to_encoder);
+
+    size_t data_size = av_get_bytes_per_sample(audio_codec_ctx->sample_fmt);
+
+    while(audio_buffer_to_encoder->size - audio_buffer_handled >= audio_frame->nb_samples * audio_codec_ctx->channels * data_size) {
+        {
+            trace_span span("audio_fill", audio_sample_pts);
+            deinterleave_audio(audio_frame, (uint8_t *)audio_buffer_to_encoder->buffer + audio_buffer_handled,
+                               audio_codec_ctx->channels, data_size);
+            audio_buffer_handled += audio_frame->nb_samples * audio_codec_ctx->channels * data_size;
+        }
+        encoder_pcm_to_aac(false);
+    }
+
+    // 已编码的PCM前移丢弃，buffer只保留不足一帧的数据
+    if(audio_buffer_handled > 0) {
+        memmove(audio_buffer_to_encoder->buffer, (uint8_t *)audio_buffer_to_encoder->buffer + audio_buffer_handled,
+                audio_buffer_to_encoder->size - audio_buffer_handled);
+        audio_buffer_to_encoder->size -= audio_buffer_handled;
+        audio_buffer_handled = 0;
+    }
+
+    // 不足一帧的PCM留到下次输入，保留期间计入预算
+    sync_pcm_charge();
+    if(!input_prepaid) {
+        budget.release(size);
+    }
+
+    return 0;
+}
+
+void video_writer::sync_pcm_charge() {
+    size_t pending = audio_buffer_to_encoder->size;
+    if(pending > pcm_charged) {
+        budget.charge(pending - pcm_charged);
+    }
+    else {
+        budget.release(pcm_charged - pending);
+    }
+    pcm_charged = pending;
+}
+
+int32_t video_writer::input_audio_file(const char *audio_file) {
+    if(mixer) {
+        std::cerr << "Error: input_audio_file can not be used with audio tracks." << std::endl;
+        return -1;
+    }
+
+    // 裸PCM按input_audio的格式解释
+    AVSampleFormat packed_fmt = av_get_packed_sample_fmt(audio_codec_ctx->sample_fmt);
+    audio_file_map file;
+    int32_t result = file.open(audio_file, audio_codec_ctx->sample_rate, audio_codec_ctx->channels, packed_fmt);
+    if(result < 0) {
+        return result;
+    }
+
+    if(file.sample_rate() == audio_codec_ctx->sample_rate && file.channels() == audio_codec_ctx->channels
+       && file.sample_fmt() == packed_fmt) {
+        return input_mapped_audio(file);
+    }
+    return input_converted_audio(file);
+}
+
+int32_t video_writer::input_mapped_audio(audio_file_map &file) {
+    const uint8_t *data = file.data();
+    size_t size = file.size();
+    int32_t result = 0;
+
+    if(spool) {
+        return spool->append_audio(data, size);
+    }
+
+    size_t data_size = av_get_bytes_per_sample(audio_codec_ctx->sample_fmt);
+    size_t frame_bytes = audio_frame->nb_samples * audio_codec_ctx->channels * data_size;
+    size_t offset = 0;
+
+    // 先补齐之前input_audio剩余的不足一帧的数据
+    if(audio_buffer_to_encoder->size > 0) {
+        offset = std::min(frame_bytes - audio_buffer_to_encoder->size, size);
+        result = input_audio((char *)data, offset);
+        if(result < 0) {
+            return result;
+        }
+    }
+
+    // 直接从映射拆分到编码帧，不经过audio_buffer_to_encoder
+    int64_t frame_count = 0;
+    while(size - offset >= frame_bytes) {
+        {
+            trace_span span("audio_fill", audio_sample_pts);
+            deinterleave_audio(audio_frame, data + offset, audio_codec_ctx->channels, data_size);
+        }
+        result = encoder_pcm_to_aac(false);
+        if(result < 0) {
+            return result;
+        }
+        offset += frame_bytes;
+
+        // 定期归还已编码部分的页，常驻内存不随文件大小增长
+        if(++frame_count % 256 == 0) {
+            file.release(offset);
+        }
+    }
+
+    // 剩余不足一帧的数据留给后续输入
+    if(offset < size) {
+        result = input_audio((char *)data + offset, size - offset);
+    }
+    return result < 0 ? result : 0;
+}
+
+int32_t video_writer::input_converted_audio(audio_file_map &file) {
+    AVSampleFormat packed_fmt = av_get_packed_sample_fmt(audio_codec_ctx->sample_fmt);
+    SwrContext *swr = swr_alloc_set_opts(nullptr, audio_codec_ctx->channel_layout, packed_fmt, audio_codec_ctx->sample_rate,
+                                         av_get_default_channel_layout(file.channels()), file.sample_fmt(), file.sample_rate(), 0, nullptr);
+    if(!swr || swr_init(swr) < 0) {
+        std::cerr << "Error: could not convert audio file with " << file.channels() << " channels at " << file.sample_rate() << " Hz." << std::endl;
+        swr_free(&swr);
+        return -1;
+    }
+    std::cout << "Convert audio file from " << av_get_sample_fmt_name(file.sample_fmt()) << " " << file.sample_rate() << " Hz" << std::endl;
+
+    // 每次转换1秒，只占用一块固定大小的转换缓存
+    size_t in_frame_bytes = file.channels() * av_get_bytes_per_sample(file.sample_fmt());
+    size_t out_frame_bytes = audio_codec_ctx->channels * av_get_bytes_per_sample(packed_fmt);
+    int64_t total_samples = file.size() / in_frame_bytes;
+    int64_t offset = 0;
+    std::vector<uint8_t> converted;
+    int32_t result = 0;
+    while(result >= 0) {
+        int in_samples = std::min((int64_t)file.sample_rate(), total_samples - offset);
+        int out_samples = swr_get_out_samples(swr, in_samples);
+        converted.resize((size_t)out_samples * out_frame_bytes);
+
+        uint8_t *out[1] = {converted.data()};
+        const uint8_t *in[1] = {file.data() + offset * in_frame_bytes};
+        // 输入为空时取出重采样器中剩余的数据
+        int samples = swr_convert(swr, out, out_samples, in_samples > 0 ? in : nullptr, in_samples);
+        if(samples < 0) {
+            std::cerr << "Error: swr_convert failed." << std::endl;
+            result = samples;
+            break;
+        }
+        if(samples > 0) {
+            result = input_audio((char *)converted.data(), samples * out_frame_bytes);
+        }
+        if(in_samples == 0) {
+            break;
+        }
+        offset += in_samples;
+        file.release(offset * in_frame_bytes);
+    }
+
+    swr_free(&swr);
+    return result < 0 ? result : 0;
+}
+
+int32_t video_writer::add_audio_track(const std::string &name, int sample_rate, int channels, AVSampleFormat sample_fmt) {
+    if(!mixer) {
+        mixer = new audio_mixer(audio_codec_ctx->sample_rate, audio_codec_ctx->channels, audio_codec_ctx->channel_layout);
+    }
+    return mixer->add_track(name, sample_rate, channels, sample_fmt);
+}
+
+int32_t video_writer::input_audio_track(const std::string &name, const char *audio_data, size_t size) {
+    if(!mixer) {
+        std::cerr << "Error: no audio track added." << std::endl;
+        return -1;
+    }
+
+    int32_t result = check_output_limit();
+    if(result < 0) {
+        return result;
+    }
+    // 输入在混音前计入预算，写入混音缓存后由encode_mixed_audio按缓存量记录
+    if(!input_prepaid) {
+        result = budget.wait_and_charge(size);
+        if(result < 0) {
+            return result;
+        }
+    }
+
+    result = mixer->write(name, (const uint8_t *)audio_data, size);
+    if(result >= 0) {
+        result = encode_mixed_audio(false);
+    }
+    if(!input_prepaid) {
+        budget.release(size);
+    }
+    return result;
+}
+
+int32_t video_writer::set_audio_track_gain(const std::string &name, float gain, int ramp_ms) {
+    if(!mixer) {
+        std::cerr << "Error: no audio track added." << std::endl;
+        return -1;
+    }
+    return mixer->set_gain(name, gain, (int64_t)ramp_ms * audio_codec_ctx->sample_rate / 1000);
+}
+
+int32_t video_writer::end_audio_track(const std::string &name) {
+    if(!mixer) {
+        std::cerr << "Error: no audio track added." << std::endl;
+        return -1;
+    }
+
+    int32_t result = mixer->end_track(name);
+    if(result < 0) {
+        return result;
+    }
+    return encode_mixed_audio(mixer->all_ended());
+}
+
+int32_t video_writer::encode_mixed_audio(bool drain) {
+    int32_t result = 0;
+    while(mixer->mix_frame(audio_frame, drain)) {
+        if(spool) {
+            // 采集模式下按input_audio的交错格式写入缓存
+            size_t data_size = av_get_bytes_per_sample(audio_codec_ctx->sample_fmt);
+            std::vector<uint8_t> interleaved(audio_frame->nb_samples * audio_codec_ctx->channels * data_size);
+            uint8_t *dst = interleaved.data();
+            for(int i = 0; i < audio_frame->nb_samples; i++) {
+                for(int ch = 0; ch < audio_codec_ctx->channels; ch++) {
+                    memcpy(dst, audio_frame->data[ch] + data_size * i, data_size);
+                    dst += data_size;
+                }
+            }
+            result = spool->append_audio(interleaved.data(), interleaved.size());
+            if(result < 0) {
+                break;
+            }
+            continue;
+        }
+        result = encoder_pcm_to_aac(false);
+        if(result < 0) {
+            break;
+        }
+    }
+
+    // 混音缓存随输入增减，同步到内存预算
+    size_t buffered = mixer->buffered_bytes();
+    if(buffered > mixer_charged) {
+        budget.charge(buffered - mixer_charged);
+    }
+    else {
+        budget.release(mixer_charged - buffered);
+    }
+    mixer_charged = buffered;
+
+    return result < 0 ? result : 0;
+}
+
+std::future<int32_t> video_writer::submit(std::function<int32_t()> task, size_t pending_bytes, writer_callback callback) {
+    std::shared_ptr<std::promise<int32_t> > promise = std::make_shared<std::promise<int32_t> >();
+    std::future<int32_t> future = promise->get_future();
+
+    ParkedTask parked;
+    parked.pending_bytes = pending_bytes;
+    parked.run = [this, task, pending_bytes, promise, callback](int32_t ret) {
+        if(ret == 0) {
+            // 本帧已计入预算，input_image/input_audio内不再等待，避免等待自己占用的预算
+            input_prepaid = pending_bytes > 0;
+            ret = task();
+            input_prepaid = false;
+            budget.release(pending_bytes);
+        }
+        promise->set_value(ret);
+        if(callback) {
+            callback(ret);
+        }
+    };
+
+    // submit和线程池都不等待预算：预算足够时立即计入并投递，不足时暂存
+    // 前面已有暂存的任务时按顺序排在后面，不能插队占用预算
+    std::lock_guard<std::mutex> lock(parked_mutex);
+    if(!parked_tasks.empty()) {
+        parked_tasks.push_back(parked);
+        return future;
+    }
+    dispatch_locked(parked);
+    return future;
+}
+
+bool video_writer::dispatch_locked(const ParkedTask &parked) {
+    int32_t ret = 0;
+    if(closing) {
+        ret = AVERROR(ECANCELED);
+    }
+    else if(parked.pending_bytes > 0) {
+        ret = budget.charge_async(parked.pending_bytes, [this](int32_t result) { resume_parked(result); });
+    }
+    if(ret > 0) {
+        parked_tasks.push_front(parked);
+        return false;
+    }
+
+    // 拒绝结果也经strand回调，调用方不会在submit内被同步回调
+    std::function<void(int32_t)> run = parked.run;
+    strand.post([run, ret]() { run(ret); });
+    return true;
+}
+
+void video_writer::resume_parked(int32_t result) {
+    std::lock_guard<std::mutex> lock(parked_mutex);
+    std::function<void(int32_t)> run = parked_tasks.front().run;
+    parked_tasks.pop_front();
+    strand.post([run, result]() { run(result); });
+
+    while(!parked_tasks.empty()) {
+        ParkedTask next = parked_tasks.front();
+        parked_tasks.pop_front();
+        if(!dispatch_locked(next)) {
+            break;
+        }
+    }
+    if(parked_tasks.empty()) {
+        parked_cond.notify_all();
+    }
+}
+
+// 降低当前线程的调度优先级，Linux下nice值按线程生效
+static void lower_thread_priority() {
+#ifdef __linux__
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+#endif
+}
+
+int32_t video_writer::enable_capture_spool(const std::string &directory) {
+    if(video_frame_count > 0) {
+        std::cerr << "Error: capture spool must be enabled before the first frame." << std::endl;
+        return -1;
+    }
+
+    if(spool) {
+        delete spool;
+    }
+    spool = new frame_spool_writer();
+    int32_t result = spool->open(directory, frame_size.width, frame_size.height, video_time_base.num, video_time_base.den,
+                                 audio_codec_ctx->sample_rate, audio_codec_ctx->channels,
+                                 av_get_bytes_per_sample(audio_codec_ctx->sample_fmt));
+    if(result < 0) {
+        delete spool;
+        spool = nullptr;
+    }
+    return result;
+}
+
+int32_t video_writer::transcode_spool(const std::string &directory, const char *output_file, spool_progress_callback progress) {
+    if(spool || video_frame_count > 0) {
+        std::cerr << "Error: transcode spool needs a writer without other input." << std::endl;
+        return -1;
+    }
+
+    frame_spool_reader reader;
+    int32_t result = reader.open(directory);
+    if(result < 0) {
+        return result;
+    }
+
+    const FrameSpoolHeader &header = reader.get_header();
+    if(header.width != frame_size.width || header.height != frame_size.height
+       || header.sample_rate != audio_codec_ctx->sample_rate || header.channels != audio_codec_ctx->channels
+       || header.bytes_per_sample != av_get_bytes_per_sample(audio_codec_ctx->sample_fmt)) {
+        std::cerr << "Error: frame spool " << directory << " does not match the writer settings." << std::endl;
+        return -1;
+    }
+
+    // 读取上次中断时的检查点
+    transcode_checkpoint checkpoint;
+    TranscodeCheckpoint state;
+    {
+        std::vector<uint8_t> video;
+        std::vector<PacketTiming> packets;
+        result = checkpoint.open(directory, transcode_settings_key(), state, video, packets);
+        if(result < 0) {
+            return result;
         }
-        else if(result < 0) {
-            std::cerr << "Error: avcodec_receive_packet failed." << std::endl;
+        if(state.frames_done > reader.size()) {
+            std::cerr << "Error: transcode checkpoint in " << directory << " is ahead of the frame spool." << std::endl;
+            return -1;
+        }
+        if(state.frames_done > 0) {
+            restore_transcode(state, video, packets);
+        }
+    }
+    size_t saved_bytes = video_buffer->size;
+    size_t saved_packets = video_packet_timings.size();
+
+    // 检查点间隔为GOP的整数倍，直接编码时检查点后的第一帧正好是固定间隔的关键帧
+    int gop = std::max(1, encoder_config.gop_size);
+    int64_t interval = (int64_t)gop * std::max(1, TRANSCODE_CHECKPOINT_SECONDS * STREAM_FRAME_RATE / gop);
+
+    AVRational spool_time_base = (AVRational){header.time_base_num, header.time_base_den};
+    int64_t total = reader.size();
+    for(int64_t i = state.frames_done; i < total; i++) {
+        video_frame->width = header.width;
+        video_frame->height = header.height;
+        video_frame->format = AV_PIX_FMT_YUV420P;
+        result = av_frame_get_buffer(video_frame, 0);
+        if(result < 0) {
+            std::cerr << "Could not allocate the video frame data." << std::endl;
             return result;
         }
-        if(flushing) {
-            std::cout << "Flushing!" << std::endl;
+
+        result = reader.read(i, video_frame);
+        if(result < 0) {
+            av_frame_unref(video_frame);
+            return result;
         }
 
-        uint8_t aac_header[7];
-        get_adts_header(audio_codec_ctx, aac_header, audio_pkt->size);
+        const FrameSpoolRecord &record = reader.record(i);
+        int64_t pts = av_rescale_q(record.pts, spool_time_base, video_time_base);
+        int64_t duration = av_rescale_q(record.duration, spool_time_base, video_time_base);
+        result = encode_video_frame(pts, duration);
+        if(result < 0) {
+            return result;
+        }
 
-        buffer_write(aac_header, 1, 7, audio_buffer);
-        buffer_write(audio_pkt->data, 1, audio_pkt->size, audio_buffer);
+        // 缓存模式只能在GOP编码完成后保存，直接编码时刷新编码器，下一帧由新编码器从IDR开始
+        if(i + 1 < total && i + 1 - state.frames_done >= interval && (!render_cache || pending_gop.empty())) {
+            if(!render_cache) {
+                result = encoder_yuv_to_h264(nullptr);
+                if(result < 0) {
+                    return result;
+                }
+                result = reset_video_encoder();
+                if(result < 0) {
+                    return result;
+                }
+                frames_since_keyframe = keyframe_max_interval;
+            }
+
+            state.frames_done = i + 1;
+            state.video_bytes = video_buffer->size;
+            state.packet_count = video_packet_timings.size();
+            state.frame_pts = frame_pts;
+            state.last_video_pts = last_video_pts;
+            state.last_video_duration = last_video_duration;
+            result = checkpoint.save(state, (uint8_t *)video_buffer->buffer + saved_bytes, video_buffer->size - saved_bytes,
+                                     video_packet_timings.data() + saved_packets, video_packet_timings.size() - saved_packets);
+            if(result < 0) {
+                return result;
+            }
+            saved_bytes = video_buffer->size;
+            saved_packets = video_packet_timings.size();
+        }
+
+        if(progress) {
+            progress(i + 1, total);
+        }
+    }
+    result = flush();
+    if(result < 0) {
+        return result;
+    }
+
+    // 音频按1秒分块送入编码器，避免一次拷贝全部PCM
+    size_t chunk_size = (size_t)header.sample_rate * header.channels * header.bytes_per_sample;
+    for(size_t offset = 0; offset < reader.audio_bytes(); offset += chunk_size) {
+        result = input_audio((char *)reader.audio_data() + offset, std::min(chunk_size, reader.audio_bytes() - offset));
+        if(result < 0) {
+            return result;
+        }
+    }
+    reader.close();
+
+    result = video_mux();
+    if(result < 0) {
+        return result;
+    }
+    result = write_video((char *)output_file);
+    if(result < 0) {
+        return result;
     }
+    checkpoint.remove();
     return 0;
 }
 
-int32_t video_writer::cvmat_to_avframe(cv::Mat &inMat)
-{
-    // 得到Mat信息
-    AVPixelFormat dstFormat = AV_PIX_FMT_YUV420P;
-    int width = inMat.cols;
-    int height = inMat.rows;
+std::string video_writer::transcode_settings_key() {
+    char key[64];
+    snprintf(key, sizeof(key), "|%d|%d|%d|%d", detector != nullptr, keyframe_min_interval, keyframe_max_interval, render_cache != nullptr);
+    return encoder_settings_key() + key;
+}
+
+void video_writer::restore_transcode(const TranscodeCheckpoint &state, const std::vector<uint8_t> &video,
+                                     const std::vector<PacketTiming> &packets) {
+    std::cout << "Resume spool transcode from frame " << state.frames_done << std::endl;
+
+    int64_t offset = video_buffer->size;
+    buffer_write((void *)video.data(), 1, video.size(), video_buffer);
+    for(size_t i = 0; i < packets.size(); i++) {
+        video_packet_timings.push_back(packets[i]);
+        h264_index.add(0, av_rescale_q(packets[i].pts, video_time_base, (AVRational){1, SEEK_INDEX_TIME_SCALE}),
+                       av_rescale_q(packets[i].dts, video_time_base, (AVRational){1, SEEK_INDEX_TIME_SCALE}),
+                       packets[i].size, offset, packets[i].flags & AV_PKT_FLAG_KEY);
+        offset += packets[i].size;
+    }
+
+    video_frame_count = state.frames_done;
+    frame_pts = state.frame_pts;
+    last_video_pts = state.last_video_pts;
+    last_video_duration = state.last_video_duration;
+    // 检查点处编码器已刷新，下一帧从IDR开始
+    frames_since_keyframe = keyframe_max_interval;
+}
 
+std::future<int32_t> video_writer::transcode_spool_async(const std::string &directory, const char *output_file,
+                                                         spool_progress_callback progress, writer_callback callback) {
+    std::shared_ptr<std::promise<int32_t> > promise = std::make_shared<std::promise<int32_t> >();
+    std::future<int32_t> future = promise->get_future();
+
+    // 每个writer只能转码一次，重复调用直接拒绝，不在调用线程上等待之前的转码
+    if(transcode_worker.joinable()) {
+        std::cerr << "Error: spool transcode already started on this writer." << std::endl;
+        strand.post([promise, callback]() {
+            promise->set_value(-1);
+            if(callback) {
+                callback(-1);
+            }
+        });
+        return future;
+    }
+
+    // 转码耗时长，使用单独的低优先级线程，不占用共享线程池
+    std::string file(output_file);
+    transcode_worker = std::thread([this, directory, file, progress, promise, callback]() {
+        lower_thread_priority();
+        video_trace::set_thread_name("transcode");
+        int32_t ret = transcode_spool(directory, file.c_str(), progress);
+        promise->set_value(ret);
+        if(callback) {
+            callback(ret);
+        }
+    });
+    return future;
+}
 
+std::future<int32_t> video_writer::input_image_async(cv::Mat png_image, writer_callback callback) {
+    return submit([this, png_image]() { return input_image(png_image); },
+                  png_image.total() * png_image.elemSize(), callback);
+}
 
+std::future<int32_t> video_writer::input_image_async(cv::Mat png_image, int64_t pts, AVRational time_base, writer_callback callback) {
+    return submit([this, png_image, pts, time_base]() { return input_image(png_image, pts, time_base); },
+                  png_image.total() * png_image.elemSize(), callback);
+}
 
+std::future<int32_t> video_writer::input_audio_async(const char *audio_data, size_t size, writer_callback callback) {
+    std::shared_ptr<std::vector<char> > data = std::make_shared<std::vector<char> >(audio_data, audio_data + size);
+    return submit([this, data]() { return input_audio(data->data(), data->size()); }, size, callback);
+}
 
+std::future<int32_t> video_writer::flush_async(writer_callback callback) {
+    return submit([this]() { return flush(); }, 0, callback);
+}
 
+std::future<int32_t> video_writer::video_mux_async(writer_callback callback) {
+    return submit([this]() { return video_mux(); }, 0, callback);
+}
 
-    video_frame->width = width;
-    video_frame->height = height;
-    video_frame->format = dstFormat;
+std::future<int32_t> video_writer::write_video_async(const char *output_file, writer_callback callback) {
+    std::string path(output_file);
+    return submit([this, path]() { return write_video(const_cast<char *>(path.c_str())); }, 0, callback);
+}
 
-    int ret = av_frame_get_buffer(video_frame, 0);
-    if (ret < 0) 
-    {
-        std::cerr << "Could not allocate the video frame data." << std::endl;
-        return -1; 
+int32_t video_writer::enable_thumbnails(const ThumbnailConfig &config) {
+    if(thumbnailer) {
+        std::cerr << "Error: thumbnails already enabled." << std::endl;
+        return -1;
     }
-    ret = av_frame_make_writable(video_frame);
-    if(ret < 0) 
-    {
-        std::cerr << "Av frame make writable failed." << std::endl;
+    if(config.thumb_size.width <= 0 || config.thumb_size.height <= 0) {
+        std::cerr << "Error: invalid thumbnail size." << std::endl;
         return -1;
     }
+    thumbnailer = new video_thumbnailer(config);
+    return 0;
+}
 
-    // 转换颜色空间为YUV420
-    // cv::setNumThreads(1)
-    cv::cvtColor(inMat, inMat, cv::COLOR_BGR2YUV_I420);
+void video_writer::finish_thumbnails() {
+    if(thumbnailer) {
+        thumbnailer->finish();
+    }
+}
 
-    // 按YUV420格式，设置数据地址
-    int frame_size = width * height;
-    unsigned char *data = inMat.data;
-    memcpy(video_frame->data[0], data, frame_size);
-    memcpy(video_frame->data[1], data + frame_size, frame_size / 4);
-    memcpy(video_frame->data[2], data + frame_size * 5 / 4, frame_size / 4);
+int32_t video_writer::add_output(const std::string &format, const std::string &file) {
+    if(!mux_targets.empty()) {
+        std::cerr << "Error: outputs must be added before video_mux." << std::endl;
+        return -1;
+    }
+    if(file.empty()) {
+        std::cerr << "Error: output file for " << format << " is empty." << std::endl;
+        return -1;
+    }
 
-    video_frame->pts = frame_pts++;
+    OutputTarget target;
+    target.format = format;
+    target.file = file;
+    extra_outputs.push_back(target);
+    return 0;
+}
 
-    encoder_yuv_to_h264(false);
+void video_writer::enable_seek_index(bool enable) {
+    seek_index_enabled = enable;
+}
 
-    av_frame_unref(video_frame);
-    
-    return 0;
+int32_t video_writer::set_overlay(int id, const cv::Mat &image, int x, int y) {
+    return overlay.set(id, image, x, y);
 }
 
-void video_writer::flush() {
-    encoder_yuv_to_h264(true);
+int32_t video_writer::set_overlay_yuva(int id, const AVFrame *frame, int x, int y, bool premultiplied) {
+    return overlay.set_yuva(id, frame, x, y, premultiplied);
 }
 
-video_writer::video_writer() {
-    STREAM_FRAME_RATE = 25;
-    frame_size = cv::Size(1280, 720);
+int32_t video_writer::move_overlay(int id, int x, int y) {
+    return overlay.move(id, x, y);
+}
 
-    init();
-    init_video_encoder();
-    init_audio_encoder();
+int32_t video_writer::show_overlay(int id, bool visible) {
+    return overlay.show(id, visible);
 }
 
-video_writer::video_writer(size_t frame_rate) {
-    STREAM_FRAME_RATE = frame_rate;
-    frame_size = cv::Size(1280, 720);
+void video_writer::remove_overlay(int id) {
+    overlay.remove(id);
+}
 
-    init();
-    init_video_encoder();
-    init_audio_encoder();
+void video_writer::clear_overlays() {
+    overlay.clear();
 }
 
-video_writer::video_writer(cv::Size image_size) {
-    STREAM_FRAME_RATE = 25;
-    frame_size = image_size;
+void video_writer::set_memory_budget(size_t limit, memory_policy policy, int64_t timeout_ms) {
+    budget.set_limit(limit);
+    budget.set_policy(policy, timeout_ms);
+}
 
-    init();
-    init_video_encoder();
-    init_audio_encoder();
+void video_writer::set_process_memory_budget(size_t limit) {
+    memory_budget::process()->set_limit(limit);
 }
 
-video_writer::video_writer(size_t frame_rate, cv::Size image_size) {
-    STREAM_FRAME_RATE = frame_rate;
-    frame_size = image_size;
+size_t video_writer::memory_usage() {
+    return budget.get_usage();
+}
 
-    init();
-    init_video_encoder();
-    init_audio_encoder();
+size_t video_writer::memory_peak() {
+    return budget.get_peak();
 }
 
-int32_t video_writer::input_image(cv::Mat png_image) {
-    cvmat_to_avframe(png_image);
-    return 0;
+void video_writer::set_output_memory_limit(size_t limit) {
+    output_budget.set_limit(limit);
 }
 
-int32_t video_writer::input_audio(char *audio_data, size_t size) {
-    buffer_write(audio_data, 1, size, audio_buffer_to_encoder);
+size_t video_writer::output_memory_usage() {
+    return output_budget.get_usage();
+}
 
-    size_t data_size = av_get_bytes_per_sample(audio_codec_ctx->sample_fmt);
+size_t video_writer::process_memory_usage() {
+    return memory_budget::process()->get_usage();
+}
 
-    while(audio_buffer_to_encoder->size - audio_buffer_handled >= audio_frame->nb_samples * audio_codec_ctx->channels * data_size) {
-        for(int i = 0; i < audio_frame->nb_samples; i++) {
-            for(int ch = 0; ch < audio_codec_ctx->channels; ch++) {
-                memcpy(audio_frame->data[ch] + data_size * i, (uint8_t *)audio_buffer_to_encoder->buffer + audio_buffer_handled, data_size);
-                audio_buffer_handled += data_size;
-            }
-        }
-        encoder_pcm_to_aac(false);
-    }
+void video_writer::enable_tracing(bool enable) {
+    video_trace::enable(enable);
+}
 
-    return 0;
+int32_t video_writer::write_trace(const char *trace_file) {
+    return video_trace::write(trace_file);
+}
+
+void video_writer::reset_trace() {
+    video_trace::reset();
+}
+
+size_t video_writer::process_memory_peak() {
+    return memory_budget::process()->get_peak();
 }
 
 video_writer::~video_writer() {
+    // 等待未完成的异步任务，仍在等待预算的任务取消
+    if(transcode_worker.joinable()) {
+        transcode_worker.join();
+    }
+    {
+        std::lock_guard<std::mutex> lock(parked_mutex);
+        closing = true;
+    }
+    budget.cancel_waits();
+    {
+        std::unique_lock<std::mutex> lock(parked_mutex);
+        parked_cond.wait(lock, [this]{ return parked_tasks.empty(); });
+    }
+    strand.wait_idle();
+
+    if(spool) {
+        spool->finish();
+        delete spool;
+    }
+
     free(video_buffer->buffer);
     free(audio_buffer->buffer);
     free(mux_buffer->buffer);
@@ -247,6 +1444,26 @@ video_writer::~video_writer() {
     free(audio_buffer);
     free(mux_buffer);
     free(audio_buffer_to_encoder);
+    output_budget.release(output_budget.get_usage());
+    budget.release(pcm_charged);
+
+    if(mixer) {
+        budget.release(mixer_charged);
+        delete mixer;
+    }
+    if(thumbnailer) {
+        delete thumbnailer;
+    }
+    if(detector) {
+        delete detector;
+    }
+    for(size_t i = 0; i < pending_gop.size(); i++) {
+        av_frame_free(&pending_gop[i]);
+    }
+    budget.release(pending_gop_bytes);
+    if(render_cache) {
+        delete render_cache;
+    }
 
     if(video_codec_ctx) {
         avcodec_free_context(&video_codec_ctx);
@@ -258,6 +1475,9 @@ video_writer::~video_writer() {
     if(video_frame) {
         av_frame_free(&video_frame);
     }
+    if(previous_frame) {
+        av_frame_free(&previous_frame);
+    }
     if(audio_frame) {
         av_frame_free(&audio_frame);
     }
@@ -277,11 +1497,9 @@ video_writer::~video_writer() {
         avformat_free_context(audio_fmt_ctx);
     }
 
-    if(output_fmt_ctx) {
-        // output_fmt_ctx->pb是直接赋值的，不能调用avio_closep
-        // avio_closep(&output_fmt_ctx->pb)
-        // avformat_close_input(&output_fmt_ctx);
-        avformat_free_context(output_fmt_ctx);
+    // 内存输出的pb是直接赋值的，由下面的mux_avio释放
+    for(size_t i = 0; i < mux_targets.size(); i++) {
+        delete mux_targets[i];
     }
 
     if(video_avio) {
@@ -301,6 +1519,9 @@ video_writer::~video_writer() {
 }
 
 int32_t video_writer::init() {
+    // 90kHz时间基，足以表示任意采集间隔
+    video_time_base = (AVRational){1, 90000};
+
     video_buffer = (MemoryBuffer *)malloc(sizeof(MemoryBuffer));
     audio_buffer = (MemoryBuffer *)malloc(sizeof(MemoryBuffer));
     mux_buffer = (MemoryBuffer *)malloc(sizeof(MemoryBuffer));
@@ -310,18 +1531,23 @@ int32_t video_writer::init() {
     video_buffer->size = 0;
     video_buffer->capacity = 0;
     video_buffer->pos = 0;
+    video_buffer->budget = &output_budget;
     audio_buffer->buffer = nullptr;
     audio_buffer->size = 0;
     audio_buffer->capacity = 0;
     audio_buffer->pos = 0;
+    audio_buffer->budget = &output_budget;
     mux_buffer->buffer = nullptr;
     mux_buffer->size = 0;
     mux_buffer->capacity = 0;
     mux_buffer->pos = 0;
+    mux_buffer->budget = &output_budget;
     audio_buffer_to_encoder->buffer = nullptr;
     audio_buffer_to_encoder->size = 0;
     audio_buffer_to_encoder->capacity = 0;
     audio_buffer_to_encoder->pos = 0;
+    // 待编码PCM按实际长度由sync_pcm_charge计入budget，不按容量统计
+    audio_buffer_to_encoder->budget = nullptr;
 
     video_pkt = av_packet_alloc();
     if(!video_pkt) {
@@ -330,7 +1556,8 @@ int32_t video_writer::init() {
     }
 
     video_frame = av_frame_alloc();
-    if(!video_frame) {
+    previous_frame = av_frame_alloc();
+    if(!video_frame || !previous_frame) {
         std::cerr << "Error: failed to alloc frame." << std::endl;
         return -1;
     }
@@ -350,24 +1577,17 @@ int32_t video_writer::init_video_encoder() {
         return -1;
     }
 
-    video_codec_ctx->profile = FF_PROFILE_H264_HIGH;
-    video_codec_ctx->bit_rate = 2000000;    // 输出码率
-
-
-
+    // 码率、线程、GOP、preset与自适应关键帧设置，与编码器校准共用
+    KeyframeConfig keyframes = {detector != nullptr, keyframe_min_interval, keyframe_max_interval};
+    // 运行时可能切换preset时固定SPS/PPS相关参数
+    apply_video_encoder_config(video_codec_ctx, encoder_config, keyframes, realtime_step_down);
 
     video_codec_ctx->width = frame_size.width;
     video_codec_ctx->height = frame_size.height;
-    video_codec_ctx->gop_size = 10;         // 关键帧间隔
-    video_codec_ctx->time_base = (AVRational){1, STREAM_FRAME_RATE};
+    video_codec_ctx->time_base = video_time_base;
     video_codec_ctx->framerate = (AVRational){STREAM_FRAME_RATE, 1};
-    video_codec_ctx->max_b_frames = 3;
     video_codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
 
-    if(video_codec->id == AV_CODEC_ID_H264) {
-        av_opt_set(video_codec_ctx->priv_data, "preset", "slow", 0);
-    }
-
     // 初始化codec_ctx
     int32_t result = avcodec_open2(video_codec_ctx, video_codec, nullptr);
     if(result < 0) {
@@ -378,6 +1598,119 @@ int32_t video_writer::init_video_encoder() {
     return 1;
 }
 
+int32_t video_writer::reset_video_encoder() {
+    if(video_codec_ctx) {
+        avcodec_free_context(&video_codec_ctx);
+    }
+    // 旧编码器中未输出的帧不会再有对应的包
+    trace_send_times.clear();
+    return init_video_encoder();
+}
+
+int32_t video_writer::set_video_encoder_config(const VideoEncoderConfig &config) {
+    if(video_frame_count > 0) {
+        std::cerr << "Error: video encoder config must be set before the first frame." << std::endl;
+        return -1;
+    }
+    if(config.gop_size <= 0 || (config.bit_rate <= 0 && config.crf <= 0) || config.crf > 51 || config.thread_count < 0) {
+        std::cerr << "Error: invalid video encoder config." << std::endl;
+        return -1;
+    }
+
+    encoder_config = config;
+    return reset_video_encoder();
+}
+
+VideoEncoderConfig video_writer::get_video_encoder_config() {
+    return encoder_config;
+}
+
+int32_t video_writer::calibrate_video_encoder(const std::string &cache_directory, double margin) {
+    if(video_frame_count > 0) {
+        std::cerr << "Error: encoder calibration must run before the first frame." << std::endl;
+        return -1;
+    }
+
+    // 按实际编码使用的全部参数校准，包括crf与自适应关键帧
+    CalibrationResult calibration;
+    KeyframeConfig keyframes = {detector != nullptr, keyframe_min_interval, keyframe_max_interval};
+    int32_t result = calibrate_encoder(encoder_config, keyframes, realtime_step_down, frame_size, STREAM_FRAME_RATE, video_time_base,
+                                       margin, cache_directory, calibration);
+    if(result < 0) {
+        return result;
+    }
+
+    encoder_config.preset = calibration.preset;
+    encoder_config.thread_count = calibration.thread_count;
+    int32_t ret = reset_video_encoder();
+    return ret < 0 ? ret : result;
+}
+
+int32_t video_writer::set_realtime_step_down(bool enable) {
+    // 开启后编码器需按固定的SPS/PPS参数重新打开，之后切换preset码流头才不变
+    if(enable && !realtime_step_down && video_frame_count > 0) {
+        std::cerr << "Error: realtime step down must be enabled before the first frame." << std::endl;
+        return -1;
+    }
+    bool changed = enable != realtime_step_down;
+    realtime_step_down = enable;
+    frames_since_step = 0;
+    frame_seconds_average = 0;
+    if(changed && video_frame_count == 0) {
+        int32_t result = reset_video_encoder();
+        return result < 0 ? result : 0;
+    }
+    return 0;
+}
+
+int32_t video_writer::set_adaptive_keyframes(int min_interval, int max_interval, double threshold) {
+    if(video_frame_count > 0) {
+        std::cerr << "Error: adaptive keyframes must be set before the first frame." << std::endl;
+        return -1;
+    }
+    if(render_cache) {
+        std::cerr << "Error: adaptive keyframes can not be used with gop cache." << std::endl;
+        return -1;
+    }
+    if(min_interval <= 0 || max_interval < min_interval) {
+        std::cerr << "Error: invalid keyframe interval [" << min_interval << ", " << max_interval << "]." << std::endl;
+        return -1;
+    }
+
+    if(detector) {
+        delete detector;
+    }
+    detector = new scene_detector(threshold);
+    keyframe_min_interval = min_interval;
+    keyframe_max_interval = max_interval;
+    return reset_video_encoder();
+}
+
+int32_t video_writer::enable_gop_cache(const std::string &directory, uint64_t max_bytes) {
+    if(video_frame_count > 0) {
+        std::cerr << "Error: gop cache must be enabled before the first frame." << std::endl;
+        return -1;
+    }
+    if(detector) {
+        std::cerr << "Error: gop cache can not be used with adaptive keyframes." << std::endl;
+        return -1;
+    }
+
+    if(render_cache) {
+        delete render_cache;
+    }
+    render_cache = new gop_cache(directory, max_bytes);
+    return 0;
+}
+
+uint64_t video_writer::gop_cache_hits() {
+    return cache_hits;
+}
+
+uint64_t video_writer::gop_cache_misses() {
+    return cache_misses;
+}
+
 int32_t video_writer::init_audio_encoder() {
     audio_codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
     if(!audio_codec) {
@@ -395,6 +1728,7 @@ int32_t video_writer::init_audio_encoder() {
     audio_codec_ctx->sample_rate = 44100;                   // 采样率
     audio_codec_ctx->channel_layout = AV_CH_LAYOUT_STEREO;  // 声道布局为立体声
     audio_codec_ctx->channels = 2;                          // 双声道
+    audio_codec_ctx->time_base = (AVRational){1, audio_codec_ctx->sample_rate};
 
     int32_t result = avcodec_open2(audio_codec_ctx, audio_codec, nullptr);
     if(result < 0) {
@@ -603,93 +1937,52 @@ int32_t video_writer::init_output() {
     mux_avio = avio_alloc_context(mux_aviobuffer, 32768, 1, mux_buffer, nullptr,
                                   write_buffer, write_seek);
 
-    avformat_alloc_output_context2(&output_fmt_ctx, nullptr, "mp4", nullptr);
-    if(!output_fmt_ctx) {
-        std::cerr << "Error: alloc output format context failed!" << std::endl;
-        return -1;
-    }
-
-    output_fmt_ctx->pb = mux_avio;
-
-
-    const AVOutputFormat *fmt = output_fmt_ctx->oformat;
-    std::cout << "Default video codec id: " << fmt->video_codec << ", audio codec id: " << fmt->audio_codec << std::endl;
-
-    AVStream *video_stream = avformat_new_stream(output_fmt_ctx, nullptr);
-    if(!video_stream) {
-        std::cerr << "Error: add video stream to output format context failed!" << std::endl;
-        return -1;
-    }
-
-    out_video_st_idx = video_stream->index;
     in_video_st_idx = av_find_best_stream(video_fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
     if(in_video_st_idx < 0) {
         std::cerr << "Error: find video stream in input video file failed!" << std::endl;
         return -1;
     }
 
-    result = avcodec_parameters_copy(video_stream->codecpar, video_fmt_ctx->streams[in_video_st_idx]->codecpar);
-    if(result < 0) {
-        std::cerr << "Error: copy video codec parameters failed!" << std::endl;
-        return -1;
-    }
-
-    video_stream->id = output_fmt_ctx->nb_streams - 1;
-    video_stream->time_base = (AVRational){1, STREAM_FRAME_RATE};
-
-    AVStream *audio_stream = avformat_new_stream(output_fmt_ctx, nullptr);
-    if(!audio_stream) {
-        std::cerr << "Error: add audio stream to output format context failed!" << std::endl;
-        return -1;
-    }
-
-    out_audio_st_idx = audio_stream->index;
     in_audio_st_idx = av_find_best_stream(audio_fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
     if(in_audio_st_idx < 0) {
         std::cerr << "Error: find audio stream in input audio file failed!" << std::endl;
         return -1;
     }
 
-    result = avcodec_parameters_copy(audio_stream->codecpar, audio_fmt_ctx->streams[in_audio_st_idx]->codecpar);
-    if(result < 0) {
-        std::cerr << "Error: copy audio codec parameters failed!" << std::endl;
-        return -1;
-    }
-
-    audio_stream->id = output_fmt_ctx->nb_streams - 1;
-    audio_stream->time_base = (AVRational){1, audio_stream->codecpar->sample_rate};
-
-    /// av_dump_format(output_fmt_ctx, 0, output_file, 1);
-    std::cout << "Output video idx: " << out_video_st_idx << ", audio idx: " << out_audio_st_idx << std::endl;
-
-
-
-
-
-
-
+    // 每个输出都按视频、音频的顺序建流
+    out_video_st_idx = 0;
+    out_audio_st_idx = 1;
+    const AVCodecParameters *video_par = video_fmt_ctx->streams[in_video_st_idx]->codecpar;
+    const AVCodecParameters *audio_par = audio_fmt_ctx->streams[in_audio_st_idx]->codecpar;
+    AVRational audio_time_base = (AVRational){1, audio_par->sample_rate};
 
+    // 第一个输出为写入内存的MP4，供write_video使用
+    mux_targets.push_back(new mux_target("mp4", ""));
+    for(size_t i = 0; i < extra_outputs.size(); i++) {
+        mux_targets.push_back(new mux_target(extra_outputs[i].format, extra_outputs[i].file));
+    }
 
+    for(size_t i = 0; i < mux_targets.size(); i++) {
+        result = mux_targets[i]->open(i == 0 ? mux_avio : nullptr, video_par, video_time_base, audio_par, audio_time_base);
+        if(result < 0) {
+            return result;
+        }
+    }
 
+    std::cout << "Output video idx: " << out_video_st_idx << ", audio idx: " << out_audio_st_idx << ", outputs: " << mux_targets.size() << std::endl;
 
     return result;
 }
 
 int32_t video_writer::muxing() {
     int32_t result = 0;
-    int64_t prev_video_dts = -1;
     int64_t cur_video_pts = 0, cur_audio_pts = 0;
     AVStream *in_video_st = video_fmt_ctx->streams[in_video_st_idx];
     AVStream *in_audio_st = audio_fmt_ctx->streams[in_audio_st_idx];
-    AVStream *output_stream = nullptr, *input_stream = nullptr;
+    AVRational cur_video_time_base = in_video_st->time_base, input_time_base;
 
     int32_t video_frame_idx = 0;
 
-    result = avformat_write_header(output_fmt_ctx, nullptr);
-    if(result < 0) {
-        return result;
-    }
-
     av_init_packet(&muxer_pkt);
     muxer_pkt.data = nullptr;
     muxer_pkt.size = 0;
@@ -697,33 +1990,71 @@ int32_t video_writer::muxing() {
     std::cout << "Video r_frame_rate: " << in_video_st->r_frame_rate.num << "/" << in_video_st->r_frame_rate.den << std::endl;
     std::cout << "Video time_base: " << in_video_st->time_base.num << "/" << in_video_st->time_base.den << std::endl;
 
-    // 循环写入音频包和视频包
+    // 有编码记录时直接按记录的包大小从h264缓存切出编码器输出的包，不经过裸流解析器
+    // 解析器可能拆分或合并包，按序号对应时间戳会使之后所有包错位
+    bool direct_video = !video_packet_timings.empty();
+    size_t video_offset = 0;
+    if(direct_video) {
+        size_t total = 0;
+        for(size_t i = 0; i < video_packet_timings.size(); i++) {
+            total += video_packet_timings[i].size;
+        }
+        if(total != video_buffer->size) {
+            std::cerr << "Error: recorded video packets (" << total << " bytes) do not match the h264 buffer ("
+                      << video_buffer->size << " bytes)." << std::endl;
+            return -1;
+        }
+    }
+
+    // 循环读取音频包和视频包，每个包只读一次，分发给所有输出
     while(1) {
-        if(av_compare_ts(cur_video_pts, in_video_st->time_base, cur_audio_pts, in_audio_st->time_base) <= 0) {
+        if(av_compare_ts(cur_video_pts, cur_video_time_base, cur_audio_pts, in_audio_st->time_base) <= 0) {
             // 视频包
-            input_stream = in_video_st;
-            result = av_read_frame(video_fmt_ctx, &muxer_pkt);
-            if(result < 0) {
-                av_packet_unref(&muxer_pkt);
-                break;
+            trace_span span("demux_read", video_frame_idx);
+            input_time_base = in_video_st->time_base;
+            if(direct_video) {
+                if(video_frame_idx >= (int32_t)video_packet_timings.size()) {
+                    break;
+                }
+                // 使用编码时记录的时间戳，保留可变帧率
+                const PacketTiming &timing = video_packet_timings[video_frame_idx];
+                muxer_pkt.data = (uint8_t *)video_buffer->buffer + video_offset;
+                muxer_pkt.size = timing.size;
+                muxer_pkt.flags = timing.flags;
+                muxer_pkt.pts = timing.pts;
+                muxer_pkt.dts = timing.dts;
+                if(video_frame_idx + 1 < (int32_t)video_packet_timings.size()) {
+                    muxer_pkt.duration = video_packet_timings[video_frame_idx + 1].dts - timing.dts;
+                }
+                else {
+                    muxer_pkt.duration = last_video_duration;
+                }
+                video_offset += timing.size;
+                input_time_base = video_time_base;
             }
-
-            if(muxer_pkt.pts == AV_NOPTS_VALUE) {
-                int64_t frame_duration = (double)AV_TIME_BASE / av_q2d(in_video_st->r_frame_rate);
-                muxer_pkt.duration = (double)frame_duration / (double)(av_q2d(in_video_st->time_base) * AV_TIME_BASE);
-                muxer_pkt.pts = (double)(video_frame_idx * frame_duration) / (double)(av_q2d(in_video_st->time_base) * AV_TIME_BASE);
-                muxer_pkt.dts = muxer_pkt.dts;
-                std::cout << "frame_duration: " << frame_duration << ", muxer_pkt.duration: " << muxer_pkt.duration << ", muxer_pkt.pts: " << muxer_pkt.pts << std::endl;
+            else {
+                result = av_read_frame(video_fmt_ctx, &muxer_pkt);
+                if(result < 0) {
+                    av_packet_unref(&muxer_pkt);
+                    break;
+                }
+                if(muxer_pkt.pts == AV_NOPTS_VALUE) {
+                    int64_t frame_duration = (double)AV_TIME_BASE / av_q2d(in_video_st->r_frame_rate);
+                    muxer_pkt.duration = (double)frame_duration / (double)(av_q2d(in_video_st->time_base) * AV_TIME_BASE);
+                    muxer_pkt.pts = (double)(video_frame_idx * frame_duration) / (double)(av_q2d(in_video_st->time_base) * AV_TIME_BASE);
+                    muxer_pkt.dts = muxer_pkt.dts;
+                    std::cout << "frame_duration: " << frame_duration << ", muxer_pkt.duration: " << muxer_pkt.duration << ", muxer_pkt.pts: " << muxer_pkt.pts << std::endl;
+                }
             }
 
             video_frame_idx++;
             cur_video_pts = muxer_pkt.pts;
+            cur_video_time_base = input_time_base;
             muxer_pkt.stream_index = out_video_st_idx;
-            output_stream = output_fmt_ctx->streams[out_video_st_idx];
         }
         else {
             // 音频包
-            input_stream = in_audio_st;
+            trace_span span("demux_read");
             result = av_read_frame(audio_fmt_ctx, &muxer_pkt);
             if(result < 0) {
                 av_packet_unref(&muxer_pkt);
@@ -731,25 +2062,30 @@ int32_t video_writer::muxing() {
             }
 
             cur_audio_pts = muxer_pkt.pts;
+            input_time_base = in_audio_st->time_base;
             muxer_pkt.stream_index = out_audio_st_idx;
-            output_stream = output_fmt_ctx->streams[out_audio_st_idx];
         }
 
-        muxer_pkt.pts = av_rescale_q_rnd(muxer_pkt.pts, input_stream->time_base, output_stream->time_base, (AVRounding)(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-        muxer_pkt.dts = av_rescale_q_rnd(muxer_pkt.dts, input_stream->time_base, output_stream->time_base, (AVRounding)(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-        muxer_pkt.duration = av_rescale_q(muxer_pkt.duration, input_stream->time_base, output_stream->time_base);
-        std::cout << "Final muxer_pts: " << muxer_pkt.pts << ", duration: " << muxer_pkt.duration << ", output_stream->time_base: " << output_stream->time_base.num << "/" << output_stream->time_base.den << std::endl;
+        std::cout << "Mux packet pts: " << muxer_pkt.pts << ", duration: " << muxer_pkt.duration << ", time_base: " << input_time_base.num << "/" << input_time_base.den << std::endl;
 
-        if(av_interleaved_write_frame(output_fmt_ctx, &muxer_pkt) < 0) {
-            std::cerr << "Error: failed to mux packet!" << std::endl;
-            break;
+        // 输出只增加包数据的引用，时间戳在各自线程中换算
+        for(size_t i = 0; i < mux_targets.size(); i++) {
+            mux_targets[i]->push(&muxer_pkt, input_time_base);
         }
         av_packet_unref(&muxer_pkt);
     }
 
-    result = av_write_trailer(output_fmt_ctx);
-    if(result < 0) {
-        return result;
+    // 等待所有输出写完，返回第一个错误
+    result = 0;
+    for(size_t i = 0; i < mux_targets.size(); i++) {
+        int32_t ret = mux_targets[i]->finish();
+        if(ret < 0 && result >= 0) {
+            result = ret;
+        }
+        if(i > 0 && seek_index_enabled) {
+            std::string index_file = mux_targets[i]->get_file() + ".vwsi";
+            mux_targets[i]->write_index(index_file.c_str());
+        }
     }
 
     return result;
@@ -780,31 +2116,49 @@ int32_t video_writer::video_mux() {
 }
 
 int32_t video_writer::write_h264(char *output_file) {
+    trace_span span("file_write");
     FILE *outputFile = fopen(output_file, "wb");
     fwrite(video_buffer->buffer, 1, video_buffer->size, outputFile);
     if(outputFile != nullptr) {
         fclose(outputFile);
         outputFile = nullptr;
     }
+
+    if(seek_index_enabled) {
+        std::string index_file = std::string(output_file) + ".vwsi";
+        return h264_index.write(index_file.c_str());
+    }
     return 0;
 }
 
 int32_t video_writer::write_aac(char *output_file) {
+    trace_span span("file_write");
     FILE *outputFile = fopen(output_file, "wb");
     fwrite(audio_buffer->buffer, 1, audio_buffer->size, outputFile);
     if(outputFile != nullptr) {
         fclose(outputFile);
         outputFile = nullptr;
     }
+
+    if(seek_index_enabled) {
+        std::string index_file = std::string(output_file) + ".vwsi";
+        return aac_index.write(index_file.c_str());
+    }
     return 0;
 }
 
 int32_t video_writer::write_video(char *output_file) {
+    trace_span span("file_write");
     FILE *outputFile = fopen(output_file, "wb");
     fwrite(mux_buffer->buffer, 1, mux_buffer->size, outputFile);
     if(outputFile != nullptr) {
         fclose(outputFile);
         outputFile = nullptr;
     }
+
+    if(seek_index_enabled) {
+        std::string index_file = std::string(output_file) + ".vwsi";
+        return mux_targets.empty() ? -1 : mux_targets[0]->write_index(index_file.c_str());
+    }
     return 0;
 }
\ No newline at end of file
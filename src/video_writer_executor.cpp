@@ -0,0 +1,91 @@
+#include "video_writer_executor.h"
+#include "video_trace.h"
+
+writer_executor::writer_executor(size_t thread_count) {
+    if(thread_count == 0) {
+        thread_count = 1;
+    }
+    for(size_t i = 0; i < thread_count; i++) {
+        workers.push_back(std::thread(&writer_executor::worker_loop, this));
+    }
+}
+
+writer_executor::~writer_executor() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cond.notify_all();
+    for(size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+writer_executor *writer_executor::instance() {
+    static writer_executor executor(std::thread::hardware_concurrency());
+    return &executor;
+}
+
+void writer_executor::post(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(task);
+    }
+    cond.notify_one();
+}
+
+void writer_executor::worker_loop() {
+    video_trace::set_thread_name("writer_executor");
+    while(1) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this]{ return stopping || !tasks.empty(); });
+            if(tasks.empty()) {
+                return;
+            }
+            task = tasks.front();
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+writer_strand::writer_strand(writer_executor *executor) {
+    this->executor = executor;
+}
+
+void writer_strand::post(std::function<void()> task) {
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.push_back(task);
+    if(!running) {
+        running = true;
+        executor->post(std::bind(&writer_strand::run_one, this));
+    }
+}
+
+// 每次只执行一个任务再重新排队，避免单个writer长期占用工作线程
+void writer_strand::run_one() {
+    std::function<void()> task;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        task = tasks.front();
+        tasks.pop_front();
+    }
+
+    task();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if(tasks.empty()) {
+        running = false;
+        idle_cond.notify_all();
+    }
+    else {
+        executor->post(std::bind(&writer_strand::run_one, this));
+    }
+}
+
+void writer_strand::wait_idle() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle_cond.wait(lock, [this]{ return !running; });
+}